@@ -0,0 +1,263 @@
+//
+// alerts.hpp : alert rules over sliding windows of RTT and loss, evaluated as results arrive
+//
+
+#ifndef ALERTS_HPP
+#define ALERTS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+
+// alert_rules class
+//
+// Rules are added by kind, then compile() turns them into a flat plan: one step per rule,
+// each naming the window it reads, and one sliding window per distinct length, shared by every
+// rule that uses it. The per-target state is laid out in flat arrays (target-major), so a
+// result touches one contiguous block of samples and one of window counters per target.
+//
+//   - threshold: mean RTT (msec) or loss ratio over the last window results above limit;
+//   - rate of change: mean RTT of the newer half of the window minus that of the older half,
+//     per result, above limit (msec per result);
+//   - percentile: the given percentile of the RTTs in the window above limit.
+//
+// Means, loss ratios and slopes are kept as running sums, so they cost O(1) per result; a
+// percentile is an nth_element over the window's RTTs, O(window) and only for the rules that
+// ask for one. A rule is only evaluated once its window is full.
+//
+// result() calls on_alert_(target, rule, firing, value) when a rule starts or stops firing
+// for a target, and at no other time.
+
+class alert_rules
+{
+public:
+	enum metric { rtt, loss };
+	enum kind { threshold, rate_of_change, percentile };
+
+	struct rule
+	{
+		std::string name;
+		kind type;
+		metric measure;
+		std::size_t window;
+		double percentile;
+		double limit;
+	};
+
+private:
+	enum opcode { rtt_mean_above, loss_above, rtt_slope_above, rtt_percentile_above };
+
+	struct step
+	{
+		opcode op;
+		std::size_t window;
+		double parameter;
+		double limit;
+	};
+
+	// Running sums of one window: results seen, losses, and RTT sum and count per half.
+	struct window_state
+	{
+		std::size_t head;
+		std::size_t filled;
+		std::size_t losses;
+		double older_sum;
+		double newer_sum;
+		std::size_t older_count;
+		std::size_t newer_count;
+	};
+
+	std::vector<rule> rules_;
+	std::vector<step> plan_;
+	std::vector<std::size_t> lengths_;
+	std::vector<std::size_t> offsets_;
+	std::size_t slots_;
+	std::vector<float> samples_;
+	std::vector<window_state> windows_;
+	std::vector<unsigned char> firing_;
+	std::vector<float> scratch_;
+
+	std::size_t add(const rule& r)
+	{
+		rules_.push_back(r);
+		return rules_.size() - 1;
+	}
+
+	// Losses are kept in the window as NaN, so that the RTT sums can skip them.
+	void push(std::size_t target, std::size_t w, float sample)
+	{
+		std::size_t length = lengths_[w];
+		float* ring = &samples_[target * slots_ + offsets_[w]];
+		window_state& s = windows_[target * lengths_.size() + w];
+		std::size_t half = length / 2;
+
+		// The sample half a window back moves from the newer half to the older one.
+		if (s.filled >= half && half > 0)
+		{
+			float middle = ring[(s.head + length - half) % length];
+			if (!std::isnan(middle))
+			{
+				s.newer_sum -= middle;
+				--s.newer_count;
+				s.older_sum += middle;
+				++s.older_count;
+			}
+		}
+
+		if (s.filled == length)
+		{
+			// A window of one has no older half.
+			float oldest = ring[s.head];
+			if (std::isnan(oldest))
+				--s.losses;
+			else if (half > 0)
+			{
+				s.older_sum -= oldest;
+				--s.older_count;
+			}
+			else
+			{
+				s.newer_sum -= oldest;
+				--s.newer_count;
+			}
+		}
+		else
+			++s.filled;
+
+		ring[s.head] = sample;
+		s.head = (s.head + 1) % length;
+		if (std::isnan(sample))
+			++s.losses;
+		else
+		{
+			s.newer_sum += sample;
+			++s.newer_count;
+		}
+	}
+
+	double evaluate(std::size_t target, const step& p)
+	{
+		const window_state& s = windows_[target * lengths_.size() + p.window];
+		switch (p.op)
+		{
+		case rtt_mean_above:
+		{
+			std::size_t count = s.older_count + s.newer_count;
+			return count ? (s.older_sum + s.newer_sum) / count : 0;
+		}
+		case loss_above:
+			return static_cast<double>(s.losses) / s.filled;
+		case rtt_slope_above:
+			if (!s.older_count || !s.newer_count)
+				return 0;
+			return (s.newer_sum / s.newer_count - s.older_sum / s.older_count) / std::max<std::size_t>(lengths_[p.window] / 2, 1);
+		case rtt_percentile_above:
+		{
+			const float* ring = &samples_[target * slots_ + offsets_[p.window]];
+			scratch_.clear();
+			for (std::size_t i = 0; i < s.filled; ++i)
+				if (!std::isnan(ring[i]))
+					scratch_.push_back(ring[i]);
+			if (scratch_.empty())
+				return 0;
+			std::size_t k = std::min(scratch_.size() - 1, static_cast<std::size_t>(p.parameter / 100 * scratch_.size()));
+			std::nth_element(scratch_.begin(), scratch_.begin() + k, scratch_.end());
+			return scratch_[k];
+		}
+		}
+		return 0;
+	}
+
+public:
+	std::function<void(std::size_t, std::size_t, bool, double)> on_alert_;
+
+	alert_rules() : slots_(0) {}
+
+	std::size_t add_threshold(const std::string& name, metric measure, std::size_t window, double limit)
+	{
+		rule r = { name, threshold, measure, window, 0, limit };
+		return add(r);
+	}
+
+	std::size_t add_rate_of_change(const std::string& name, std::size_t window, double limit)
+	{
+		rule r = { name, rate_of_change, rtt, std::max<std::size_t>(window, 2), 0, limit };
+		return add(r);
+	}
+
+	std::size_t add_percentile(const std::string& name, std::size_t window, double percentile, double limit)
+	{
+		rule r = { name, alert_rules::percentile, rtt, window, percentile, limit };
+		return add(r);
+	}
+
+	bool empty() const { return rules_.empty(); }
+	const rule& rules(std::size_t index) const { return rules_[index]; }
+
+	// Builds the plan and the state of every target; the state starts empty.
+	void compile(std::size_t targets)
+	{
+		plan_.clear();
+		lengths_.clear();
+		offsets_.clear();
+		slots_ = 0;
+
+		for (std::size_t i = 0; i < rules_.size(); ++i)
+		{
+			const rule& r = rules_[i];
+			std::size_t length = std::max<std::size_t>(r.window, 1);
+			std::size_t w = std::find(lengths_.begin(), lengths_.end(), length) - lengths_.begin();
+			if (w == lengths_.size())
+			{
+				lengths_.push_back(length);
+				offsets_.push_back(slots_);
+				slots_ += length;
+			}
+
+			step p = { rtt_mean_above, w, r.percentile, r.limit };
+			if (r.type == threshold && r.measure == loss)
+				p.op = loss_above;
+			else if (r.type == rate_of_change)
+				p.op = rtt_slope_above;
+			else if (r.type == percentile)
+				p.op = rtt_percentile_above;
+			plan_.push_back(p);
+		}
+
+		samples_.assign(targets * slots_, 0);
+		window_state empty = { 0, 0, 0, 0, 0, 0, 0 };
+		windows_.assign(targets * lengths_.size(), empty);
+		firing_.assign(targets * rules_.size(), 0);
+	}
+
+	bool firing(std::size_t target, std::size_t rule) const { return firing_[target * rules_.size() + rule] != 0; }
+
+	// Feeds one result of a target, rtt in msec for a reply.
+	void result(std::size_t target, bool replied, double rtt)
+	{
+		float sample = replied ? static_cast<float>(rtt) : std::nanf("");
+		for (std::size_t w = 0; w < lengths_.size(); ++w)
+			push(target, w, sample);
+
+		unsigned char* firing = &firing_[target * rules_.size()];
+		for (std::size_t i = 0; i < plan_.size(); ++i)
+		{
+			const step& p = plan_[i];
+			if (windows_[target * lengths_.size() + p.window].filled < lengths_[p.window])
+				continue;
+
+			double value = evaluate(target, p);
+			unsigned char now = value > p.limit ? 1 : 0;
+			if (now != firing[i])
+			{
+				firing[i] = now;
+				if (on_alert_)
+					on_alert_(target, i, now != 0, value);
+			}
+		}
+	}
+};
+
+#endif // ALERTS_HPP
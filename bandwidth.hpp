@@ -0,0 +1,355 @@
+//
+// bandwidth.hpp : packet-pair capacity and probe-train available bandwidth estimation
+// void bandwidth_ping(hex_ip4_address, report_stream)
+//
+
+#ifndef BANDWIDTH_HPP
+#define BANDWIDTH_HPP
+
+#include "ping.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+
+#if defined(__linux__)
+#include "txtime.hpp"
+#endif
+
+// bandwidth_prober class
+//
+// Capacity: pairs_ pairs of full-size echo requests are sent back to back. The bottleneck
+// link spreads each pair apart by the time it takes to serialize one packet, and the replies
+// keep that spacing, so size / dispersion is the bottleneck capacity. Pairs disturbed by
+// cross traffic are outliers on both sides, and the median of the estimates is kept.
+//
+// Available bandwidth: trains of train_length_ requests are sent at a given input rate. When
+// the rate exceeds what is left on the path, the queue grows along the train and the replies
+// come back slower than they were sent. A binary search over the input rate, between zero and
+// the capacity, finds the highest rate whose trains come back at (1 - tolerance_) of the
+// input rate or better.
+//
+// Arrival times are the kernel's receive timestamps (SO_TIMESTAMPNS) where available, so that
+// handler latency does not add to the dispersion. Trains are paced by spinning on the clock,
+// or, after use_txtime(), handed to the kernel at once with SO_TXTIME launch times.
+
+class bandwidth_prober
+{
+private:
+	icmp::socket socket_;
+	steady_timer timer_;
+	icmp::endpoint destination_;
+	echo_payload payload_;
+	unsigned char request_header_[8];
+	unsigned char reply_[2048];
+	unsigned short sequence_number_;
+
+	// The batch (pair or train) in flight.
+	unsigned short first_sequence_;
+	std::size_t batch_size_;
+	std::size_t batch_received_;
+	double batch_rate_;
+	std::vector<int64_t> arrivals_;
+	bool waiting_;
+
+	std::size_t pairs_sent_;
+	std::vector<double> pair_estimates_;
+	double capacity_;
+	double low_rate_;
+	double high_rate_;
+	std::size_t trains_sent_;
+#if defined(__linux__)
+	std::unique_ptr<txtime_sender> txtime_;
+#endif
+
+	double packet_bits() const { return (20 + 8 + payload_.size()) * 8.0; }
+
+	static int64_t now_nanoseconds()
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(steady_timer::clock_type::now().time_since_epoch()).count();
+	}
+
+	void send_one(chrono::steady_clock::time_point launch)
+	{
+		const std::vector<unsigned char>& body = payload_.next(++sequence_number_);
+
+		icmp_header echo_request;
+		echo_request.type(icmp_header::echo_request);
+		echo_request.code(0);
+		echo_request.identifier(pinger::get_identifier());
+		echo_request.sequence_number(sequence_number_);
+		compute_checksum(echo_request, body.begin(), body.end());
+		echo_request.write(request_header_);
+
+		std::array<boost::asio::const_buffer, 2> request = { { boost::asio::buffer(request_header_), boost::asio::buffer(body) } };
+#if defined(__linux__)
+		if (txtime_)
+		{
+			txtime_->send_to(request, destination_, txtime_sender::launch_time(launch));
+			return;
+		}
+#endif
+		while (steady_timer::clock_type::now() < launch)
+			;
+		socket_.send_to(request, destination_);
+	}
+
+	// Sends count requests, spaced for the given rate in bits per second, back to back if 0.
+	void send_batch(std::size_t count, double rate)
+	{
+		first_sequence_ = static_cast<unsigned short>(sequence_number_ + 1);
+		batch_size_ = count;
+		batch_received_ = 0;
+		batch_rate_ = rate;
+		arrivals_.assign(count, -1);
+
+		chrono::steady_clock::duration spacing = rate > 0
+			? chrono::duration_cast<chrono::steady_clock::duration>(chrono::nanoseconds(static_cast<int64_t>(packet_bits() / rate * 1e9)))
+			: chrono::steady_clock::duration::zero();
+		// With launch times, leave the kernel time to queue the whole train before it starts.
+		chrono::steady_clock::time_point launch = steady_timer::clock_type::now();
+#if defined(__linux__)
+		if (txtime_)
+			launch += chrono::milliseconds(1);
+#endif
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			send_one(launch);
+			launch += spacing;
+		}
+
+		waiting_ = true;
+		timer_.expires_after(chrono::milliseconds(timeout_));
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_timeout lambda, also called when the last reply cuts the wait short
+				if (socket_.is_open())
+					end_batch();
+			});
+	}
+
+	// Output rate in bits per second between the first and the last reply that came back.
+	double output_rate() const
+	{
+		std::size_t first = batch_size_, last = 0;
+		for (std::size_t i = 0; i < batch_size_; ++i)
+		{
+			if (arrivals_[i] < 0)
+				continue;
+			first = std::min(first, i);
+			last = i;
+		}
+		if (first >= last || arrivals_[last] <= arrivals_[first])
+			return 0;
+		return (last - first) * packet_bits() / ((arrivals_[last] - arrivals_[first]) / 1e9);
+	}
+
+	void end_batch()
+	{
+		waiting_ = false;
+
+		if (batch_rate_ == 0)
+		{
+			double estimate = output_rate();
+			if (estimate > 0 && arrivals_[0] >= 0 && arrivals_[1] >= 0)
+				pair_estimates_.push_back(estimate);
+		}
+		else
+		{
+			// Trains that lost half their packets did not get through at that rate either.
+			double out = batch_received_ * 2 >= batch_size_ ? output_rate() : 0;
+			if (out >= batch_rate_ * (1 - tolerance_))
+				low_rate_ = batch_rate_;
+			else
+				high_rate_ = batch_rate_;
+		}
+
+		timer_.expires_after(chrono::milliseconds(timer_interval_));
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_interval lambda
+				if (!error)
+					next_batch();
+			});
+	}
+
+	void next_batch()
+	{
+		if (pairs_sent_ < pairs_)
+		{
+			++pairs_sent_;
+			send_batch(2, 0);
+			return;
+		}
+
+		if (capacity_ == 0 && !pair_estimates_.empty())
+		{
+			std::vector<double> estimates = pair_estimates_;
+			std::nth_element(estimates.begin(), estimates.begin() + estimates.size() / 2, estimates.end());
+			capacity_ = estimates[estimates.size() / 2];
+			low_rate_ = 0;
+			high_rate_ = capacity_;
+		}
+
+		if (capacity_ > 0 && trains_sent_ < trains_)
+		{
+			++trains_sent_;
+			send_batch(train_length_, (low_rate_ + high_rate_) / 2);
+			return;
+		}
+
+		socket_.close();
+	}
+
+	// Takes the next reply off the socket without blocking, with its arrival time in nanoseconds.
+	bool receive(std::size_t& length, int64_t& arrival)
+	{
+#if defined(__linux__)
+		char control[CMSG_SPACE(sizeof(timespec))];
+		iovec iov = { reply_, sizeof(reply_) };
+		msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		ssize_t received = ::recvmsg(socket_.native_handle(), &message, MSG_DONTWAIT);
+		if (received < 0)
+			return false;
+		length = static_cast<std::size_t>(received);
+
+		arrival = now_nanoseconds();
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			{
+				timespec stamp;
+				std::memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+				arrival = static_cast<int64_t>(stamp.tv_sec) * 1000000000 + stamp.tv_nsec;
+			}
+		}
+		return true;
+#else
+		boost::system::error_code error;
+		length = socket_.receive(boost::asio::buffer(reply_), 0, error);
+		arrival = now_nanoseconds();
+		return !error;
+#endif
+	}
+
+	void handle_reply(std::size_t length, int64_t arrival)
+	{
+		if (!checksums_.verify_icmp(reply_, length, sizeof(reply_)))
+			return;
+
+		ipv4_header ipv4_hdr;
+		icmp_header icmp_hdr;
+		if (!ipv4_hdr.parse(reply_, length)
+			|| !icmp_hdr.parse(reply_ + ipv4_hdr.header_length(), length - ipv4_hdr.header_length()))
+			return;
+
+		if (!waiting_ || icmp_hdr.type() != icmp_header::echo_reply || icmp_hdr.identifier() != pinger::get_identifier()
+			|| ipv4_hdr.source_address() != destination_.address().to_v4())
+			return;
+
+		std::size_t index = static_cast<unsigned short>(icmp_hdr.sequence_number() - first_sequence_);
+		if (index >= batch_size_ || arrivals_[index] >= 0)
+			return;
+
+		arrivals_[index] = arrival;
+		if (++batch_received_ == batch_size_)
+			timer_.cancel();
+	}
+
+public:
+	std::size_t pairs_;
+	std::size_t train_length_;
+	std::size_t trains_;
+	double tolerance_;
+	uint16_t timer_interval_;
+	uint16_t timeout_;
+	checksum_verifier checksums_;
+
+	bandwidth_prober(boost::asio::io_context& ping_io_context, boost::asio::ip::address_v4 destination, std::size_t payload_size = 1400)
+		: socket_(ping_io_context, icmp::v4()), timer_(ping_io_context), destination_(destination, 0),
+		payload_(payload_size), sequence_number_(0), first_sequence_(0), batch_size_(0), batch_received_(0),
+		batch_rate_(0), waiting_(false), pairs_sent_(0), capacity_(0), low_rate_(0), high_rate_(0), trains_sent_(0),
+		pairs_(20), train_length_(50), trains_(8), tolerance_(0.05), timer_interval_(100), timeout_(1000)
+	{
+#if defined(__linux__)
+		int on = 1;
+		::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#endif
+		socket_.non_blocking(true);
+	}
+
+#if defined(__linux__)
+	// Paces trains with SO_TXTIME instead of spinning; the launch times are on CLOCK_MONOTONIC,
+	// so the interface needs the fq qdisc.
+	void use_txtime()
+	{
+		txtime_.reset(new txtime_sender(socket_.native_handle()));
+	}
+#endif
+
+	void start()
+	{
+		start_receive();
+		next_batch();
+	}
+
+	void start_receive()
+	{
+		socket_.async_wait(icmp::socket::wait_read, [this](const boost::system::error_code& error)
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				std::size_t length = 0;
+				int64_t arrival = 0;
+				while (receive(length, arrival))
+					handle_reply(length, arrival);
+
+				start_receive();
+			});
+	}
+
+	// Bottleneck capacity in bits per second, 0 if no pair came back whole.
+	double capacity() const { return capacity_; }
+
+	// Available bandwidth in bits per second: the highest train rate that got through undisturbed.
+	double available_bandwidth() const { return low_rate_; }
+
+	void report(std::ostream& os) const
+	{
+		os << std::fixed << std::setprecision(3)
+			<< " pairs " << pair_estimates_.size() << "/" << pairs_sent_
+			<< ", capacity " << capacity_ / 1e6 << " Mbit/s"
+			<< ", available " << low_rate_ / 1e6 << " Mbit/s (" << trains_sent_ << " trains)";
+		if (checksums_.corrupted())
+			os << ", corrupted " << checksums_.corrupted();
+		os << "\n";
+	}
+};
+
+void bandwidth_ping(uint32_t address, std::ostream& os)
+{
+	boost::asio::io_context ping_io_context;
+
+	try
+	{
+		bandwidth_prober b(ping_io_context, boost::asio::ip::address_v4(address));
+		b.start();
+
+		ping_io_context.run();
+
+		b.report(os);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+}
+
+#endif // BANDWIDTH_HPP
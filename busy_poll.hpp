@@ -0,0 +1,156 @@
+//
+// busy_poll.hpp : latency-first receive mode, a pinned thread spinning on the reactor (Linux only)
+// bool ping_busy_poll(hex_ip4_address, count, timer_millisecond, cpu)
+//
+
+#ifndef BUSY_POLL_HPP
+#define BUSY_POLL_HPP
+
+#include "packet_ring.hpp"
+
+#if defined(__linux__)
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+// Lets receive calls on a socket poll the device queue for up to microseconds before they
+// sleep. prefer asks the kernel to leave the queue to busy polling rather than to interrupts
+// and softirq processing; budget, if not 0, caps the packets taken per poll. Raising the time
+// above net.core.busy_read takes CAP_NET_ADMIN. Busy polling from epoll, which is what the
+// reactor waits in, follows net.core.busy_poll.
+inline void busy_poll(int fd, unsigned int microseconds, bool prefer = true, unsigned short budget = 0)
+{
+	int value = static_cast<int>(microseconds);
+	if (::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) < 0)
+		throw_errno("SO_BUSY_POLL");
+
+	value = prefer ? 1 : 0;
+	if (::setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, sizeof(value)) < 0 && prefer)
+		throw_errno("SO_PREFER_BUSY_POLL");
+
+	value = budget;
+	if (budget && ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &value, sizeof(value)) < 0)
+		throw_errno("SO_BUSY_POLL_BUDGET");
+}
+
+// busy_poll() as far as it goes: each option is set on its own and a refusal is skipped, since
+// without CAP_NET_ADMIN, or before Linux 5.11 for the last two, the socket works as it did and
+// only the device queue is polled less. True if every option took.
+inline bool try_busy_poll(int fd, unsigned int microseconds, bool prefer = true, unsigned short budget = 0)
+{
+	bool all = true;
+	int value = static_cast<int>(microseconds);
+	if (::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) < 0)
+		all = false;
+
+	value = prefer ? 1 : 0;
+	if (::setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, sizeof(value)) < 0 && prefer)
+		all = false;
+
+	value = budget;
+	if (budget && ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &value, sizeof(value)) < 0)
+		all = false;
+	return all;
+}
+
+// Runs an io_context without sleeping in the reactor while there is traffic.
+//
+// The loop calls io_context::poll(), which runs whatever is ready and never blocks, over and
+// over. After spin_ without a single handler to run it backs off to run_one_for(backoff_),
+// which sleeps in the reactor as run() would, and spins again as soon as a handler has run.
+// A zero spin_ is run() one handler at a time; a zero backoff_ never sleeps at all.
+//
+// With cpu_ set, run() pins the calling thread to that CPU first, so that the spinning core
+// stays warm and the thread is never migrated between handlers.
+
+class busy_poll_runner
+{
+private:
+	boost::asio::io_context& io_context_;
+
+public:
+	chrono::microseconds spin_;
+	chrono::microseconds backoff_;
+	int cpu_;
+
+	busy_poll_runner(boost::asio::io_context& io_context, chrono::microseconds spin = chrono::microseconds(1000),
+		chrono::microseconds backoff = chrono::microseconds(10000), int cpu = -1)
+		: io_context_(io_context), spin_(spin), backoff_(backoff), cpu_(cpu)
+	{
+	}
+
+	// Returns the number of handlers run, once the io_context is out of work or stopped.
+	std::size_t run()
+	{
+		if (cpu_ >= 0)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu_ % CPU_SETSIZE, &cpus);
+			::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus);
+		}
+
+		std::size_t handled = 0;
+		chrono::steady_clock::time_point active = steady_timer::clock_type::now();
+		while (!io_context_.stopped())
+		{
+			std::size_t n = io_context_.poll();
+			if (n == 0 && steady_timer::clock_type::now() - active >= spin_)
+			{
+				if (backoff_ == chrono::microseconds::zero())
+					continue;
+				n = io_context_.run_one_for(backoff_);
+			}
+
+			if (n)
+			{
+				handled += n;
+				active = steady_timer::clock_type::now();
+			}
+		}
+		return handled;
+	}
+};
+
+// ping() with busy polling on the socket and the io_context run by a busy_poll_runner on a
+// thread of its own, pinned to cpu unless it is negative, so the caller keeps its own affinity.
+// Socket options the process may not set are left out; the runner spins all the same.
+bool ping_busy_poll(uint32_t address, uint8_t count, uint16_t timer_milliseconds, int cpu = -1)
+{
+	boost::asio::io_context ping_io_context;
+
+	pinger p(ping_io_context);
+	p.destination_.address(boost::asio::ip::address_v4(address));
+	p.count_ = (count < 2 ? 2 : count);
+	p.timer_interval_ = timer_milliseconds;
+
+	try
+	{
+		try_busy_poll(p.native_handle(), 50);
+
+		p.start_send();
+		p.start_receive();
+
+		busy_poll_runner runner(ping_io_context);
+		runner.cpu_ = cpu;
+		std::thread spinner([&runner]() { runner.run(); });
+		spinner.join();
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+
+	return (((uint8_t)p.num_replies_ > p.count_ / 2) ? true : false);
+}
+
+#endif // __linux__
+
+#endif // BUSY_POLL_HPP
@@ -0,0 +1,253 @@
+//
+// dscp_probe.hpp : latency and loss of the same targets under several DSCP markings
+// void dscp_ping(hex_ip4_addresses, dscp_values, count, timer_millisecond, report_stream)
+//
+
+#ifndef DSCP_PROBE_HPP
+#define DSCP_PROBE_HPP
+
+#include "ping.hpp"
+#include <iomanip>
+#include <map>
+
+// dscp_prober class
+//
+// Every round sends one echo request per target and per traffic class, back to back on one
+// IP_HDRINCL socket, so that all classes see the same network conditions. The order of the
+// classes rotates from one round to the next so that none of them is always sent first.
+// Statistics are kept per target and class; a reply whose TOS byte no longer carries the DSCP
+// it was sent with is counted as remarked (the responder echoes the request's TOS back).
+// Targets filter_ refuses at the first round are never probed.
+
+class dscp_prober
+{
+private:
+	struct probe
+	{
+		std::size_t target;
+		std::size_t traffic_class;
+		chrono::steady_clock::time_point time_sent;
+	};
+
+	icmp::socket socket_;
+	steady_timer timer_;
+	boost::asio::streambuf reply_buffer_;
+	std::vector<icmp::endpoint> targets_;
+	std::vector<unsigned char> dscp_;
+	std::vector<ipv4_header> templates_;
+	std::vector<probe_statistics> statistics_;
+	std::vector<probe_statistics> class_statistics_;
+	std::vector<std::size_t> remarked_;
+	std::vector<unsigned char> excluded_;
+	std::map<unsigned short, probe> outstanding_;
+	unsigned short sequence_number_;
+	std::size_t round_;
+
+	std::size_t index(std::size_t target, std::size_t traffic_class) const { return target * dscp_.size() + traffic_class; }
+
+	// Probes still unanswered after the timeout stay counted as lost.
+	void expire(chrono::steady_clock::time_point deadline)
+	{
+		for (std::map<unsigned short, probe>::iterator it = outstanding_.begin(); it != outstanding_.end();)
+		{
+			if (it->second.time_sent < deadline)
+				outstanding_.erase(it++);
+			else
+				++it;
+		}
+	}
+
+	void send(std::size_t target, std::size_t traffic_class)
+	{
+		std::string body("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+
+		icmp_header echo_request;
+		echo_request.type(icmp_header::echo_request);
+		echo_request.code(0);
+		echo_request.identifier(pinger::get_identifier());
+		echo_request.sequence_number(++sequence_number_);
+		compute_checksum(echo_request, body.begin(), body.end());
+
+		ipv4_header ipv4_hdr = templates_[traffic_class];
+		ipv4_hdr.total_length(static_cast<unsigned short>(ipv4_hdr.header_length() + 8 + body.size()));
+		ipv4_hdr.destination_address(targets_[target].address().to_v4());
+		compute_checksum(ipv4_hdr);
+
+		boost::asio::streambuf request_buffer;
+		std::ostream os(&request_buffer);
+		os << ipv4_hdr << echo_request << body;
+
+		probe p = { target, traffic_class, steady_timer::clock_type::now() };
+		outstanding_[sequence_number_] = p;
+		statistics_[index(target, traffic_class)].add_sent();
+		class_statistics_[traffic_class].add_sent();
+		socket_.send_to(request_buffer.data(), targets_[target]);
+	}
+
+public:
+	std::size_t count_;
+	uint16_t timer_interval_;
+	uint16_t timeout_;
+	const target_filter* filter_;
+	checksum_verifier checksums_;
+
+	// DSCP values are the 6-bit code points, e.g. 46 for EF and 0 for best effort. The first
+	// class is the baseline the others are compared with in the report.
+	dscp_prober(boost::asio::io_context& ping_io_context, const std::vector<boost::asio::ip::address_v4>& targets,
+		const std::vector<unsigned char>& dscp_values)
+		: socket_(ping_io_context, icmp::v4()), timer_(ping_io_context), dscp_(dscp_values),
+		statistics_(targets.size() * dscp_values.size()), class_statistics_(dscp_values.size()), remarked_(dscp_values.size()),
+		excluded_(targets.size(), 0), sequence_number_(0), round_(0), count_(5), timer_interval_(1000), timeout_(1000), filter_(0)
+	{
+		for (std::size_t i = 0; i < targets.size(); ++i)
+			targets_.push_back(icmp::endpoint(targets[i], 0));
+		for (std::size_t i = 0; i < dscp_.size(); ++i)
+			templates_.push_back(icmp_ipv4_template(static_cast<unsigned char>(dscp_[i] << 2)));
+
+		socket_.set_option(ip_header_included(true));
+	}
+
+	void start_send()
+	{
+		chrono::steady_clock::time_point now = steady_timer::clock_type::now();
+		expire(now - chrono::milliseconds(timeout_));
+
+		if (round_ >= count_)
+		{
+			socket_.close();
+			return;
+		}
+
+		if (round_ == 0 && filter_)
+			for (std::size_t target = 0; target < targets_.size(); ++target)
+				excluded_[target] = !filter_->permits(targets_[target].address());
+
+		for (std::size_t target = 0; target < targets_.size(); ++target)
+			if (!excluded_[target])
+				for (std::size_t i = 0; i < dscp_.size(); ++i)
+					send(target, (i + round_) % dscp_.size());
+		++round_;
+
+		// After the last round, wait for the timeout instead of the interval.
+		timer_.expires_at(now + chrono::milliseconds(round_ < count_ ? timer_interval_ : timeout_));
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_timeout lambda
+				if (!error)
+					start_send();
+			});
+	}
+
+	void handle_reply(const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr)
+	{
+		if (icmp_hdr.type() != icmp_header::echo_reply || icmp_hdr.identifier() != pinger::get_identifier())
+			return;
+
+		std::map<unsigned short, probe>::iterator it = outstanding_.find(icmp_hdr.sequence_number());
+		if (it == outstanding_.end() || ipv4_hdr.source_address() != targets_[it->second.target].address().to_v4())
+			return;
+
+		const probe& p = it->second;
+		chrono::steady_clock::duration rtt = steady_timer::clock_type::now() - p.time_sent;
+		statistics_[index(p.target, p.traffic_class)].add_reply(rtt);
+		class_statistics_[p.traffic_class].add_reply(rtt);
+		if ((ipv4_hdr.type_of_service() >> 2) != dscp_[p.traffic_class])
+			++remarked_[p.traffic_class];
+		outstanding_.erase(it);
+	}
+
+	void start_receive()
+	{
+		reply_buffer_.consume(reply_buffer_.size());
+
+		socket_.async_receive(reply_buffer_.prepare(1024), [this](const boost::system::error_code& error, std::size_t bytes_transferred)
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				reply_buffer_.commit(bytes_transferred);
+
+				if (checksums_.verify_icmp(static_cast<const unsigned char*>(reply_buffer_.data().data()), bytes_transferred, 1024))
+				{
+					std::istream is(&reply_buffer_);
+					ipv4_header ipv4_hdr;
+					icmp_header icmp_hdr;
+					is >> ipv4_hdr >> icmp_hdr;
+
+					if (is)
+						handle_reply(ipv4_hdr, icmp_hdr);
+				}
+
+				start_receive();
+			});
+	}
+
+	const probe_statistics& statistics(std::size_t target, std::size_t traffic_class) const { return statistics_[index(target, traffic_class)]; }
+
+	// Statistics of one class over all targets.
+	const probe_statistics& class_statistics(std::size_t traffic_class) const { return class_statistics_[traffic_class]; }
+
+	std::size_t remarked(std::size_t traffic_class) const { return remarked_[traffic_class]; }
+
+	bool excluded(std::size_t target) const { return excluded_[target] != 0; }
+
+	void report(std::ostream& os) const
+	{
+		if (dscp_.empty())
+			return;
+
+		const probe_statistics& baseline = class_statistics_[0];
+		os << std::fixed << std::setprecision(3);
+		for (std::size_t c = 0; c < dscp_.size(); ++c)
+		{
+			const probe_statistics& s = class_statistics_[c];
+			os << " dscp " << static_cast<int>(dscp_[c])
+				<< ": sent " << s.sent() << ", received " << s.received()
+				<< ", loss " << s.loss() * 100 << "%, rtt " << s.mean_rtt() << "/" << s.stddev_rtt() << " msec"
+				<< ", remarked " << remarked_[c];
+			if (c > 0)
+				os << " (vs dscp " << static_cast<int>(dscp_[0]) << ": rtt " << s.mean_rtt() - baseline.mean_rtt()
+					<< " msec, loss " << (s.loss() - baseline.loss()) * 100 << "%)";
+			os << "\n";
+		}
+
+		std::size_t refused = 0;
+		for (std::size_t i = 0; i < excluded_.size(); ++i)
+			refused += excluded_[i];
+		if (refused)
+			os << " excluded " << refused << " of " << targets_.size() << " targets\n";
+		if (checksums_.corrupted())
+			os << " corrupted " << checksums_.corrupted() << "\n";
+	}
+};
+
+void dscp_ping(const std::vector<uint32_t>& addresses, const std::vector<unsigned char>& dscp_values,
+	uint8_t count, uint16_t timer_milliseconds, std::ostream& os)
+{
+	boost::asio::io_context ping_io_context;
+
+	std::vector<boost::asio::ip::address_v4> targets;
+	for (std::size_t i = 0; i < addresses.size(); ++i)
+		targets.push_back(boost::asio::ip::address_v4(addresses[i]));
+
+	try
+	{
+		dscp_prober p(ping_io_context, targets, dscp_values);
+		p.count_ = count;
+		p.timer_interval_ = timer_milliseconds;
+
+		p.start_send();
+		p.start_receive();
+
+		ping_io_context.run();
+
+		p.report(os);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+}
+
+#endif // DSCP_PROBE_HPP
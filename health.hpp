@@ -0,0 +1,129 @@
+//
+// health.hpp : up / degraded / down / flapping state of a target, from its probe results
+//
+
+#ifndef HEALTH_HPP
+#define HEALTH_HPP
+
+#include <cstddef>
+#include <ostream>
+
+// Thresholds shared by the health_state of many targets.
+//
+//   - down_after losses in a row take a target down, up_after replies in a row bring it back;
+//   - a target that is up is degraded when the moving average of its loss goes above
+//     degraded_loss, or that of its RTT above degraded_rtt (in msec, 0 for no RTT threshold),
+//     and up again once both are below recovery times their thresholds;
+//   - every change between down and the other states adds 1 to a flap score that decays by
+//     flap_decay per result; the target is flapping above flap_high, and stops once the score
+//     has decayed below flap_low.
+//
+// Each pair of thresholds is a hysteresis band, so a target sitting on one does not produce a
+// stream of events. alpha is the weight of the latest result in the moving averages.
+
+struct health_thresholds
+{
+	std::size_t down_after;
+	std::size_t up_after;
+	double degraded_loss;
+	double degraded_rtt;
+	double recovery;
+	double flap_decay;
+	double flap_high;
+	double flap_low;
+	double alpha;
+
+	health_thresholds()
+		: down_after(3), up_after(2), degraded_loss(0.1), degraded_rtt(0), recovery(0.5),
+		flap_decay(0.9), flap_high(3), flap_low(1), alpha(0.1)
+	{
+	}
+};
+
+// Health of one target, updated in constant time per probe result.
+
+class health_state
+{
+public:
+	enum state { up, degraded, down, flapping };
+
+private:
+	state base_;
+	state state_;
+	std::size_t losses_in_row_;
+	std::size_t replies_in_row_;
+	double loss_;
+	double rtt_;
+	double flap_score_;
+
+public:
+	health_state() : base_(up), state_(up), losses_in_row_(0), replies_in_row_(0), loss_(0), rtt_(0), flap_score_(0) {}
+
+	// The state events are about: flapping hides the up and down underneath it.
+	state current() const { return state_; }
+
+	// Down or not, flapping or not; what a dependent target waits on.
+	bool is_down() const { return base_ == down; }
+
+	std::size_t losses_in_row() const { return losses_in_row_; }
+	double loss() const { return loss_; }
+	double rtt() const { return rtt_; }
+	double flap_score() const { return flap_score_; }
+
+	// Feeds one result, rtt in msec for a reply; true if current() changed.
+	bool update(const health_thresholds& h, bool replied, double rtt = 0)
+	{
+		loss_ += h.alpha * ((replied ? 0.0 : 1.0) - loss_);
+		if (replied)
+		{
+			rtt_ = rtt_ > 0 ? rtt_ + h.alpha * (rtt - rtt_) : rtt;
+			++replies_in_row_;
+			losses_in_row_ = 0;
+		}
+		else
+		{
+			++losses_in_row_;
+			replies_in_row_ = 0;
+		}
+
+		state base = base_;
+		if (base == down)
+		{
+			if (replies_in_row_ >= h.up_after)
+				base = up;
+		}
+		else if (losses_in_row_ >= h.down_after)
+			base = down;
+
+		if (base == up || base == degraded)
+		{
+			bool over = loss_ > h.degraded_loss || (h.degraded_rtt > 0 && rtt_ > h.degraded_rtt);
+			bool under = loss_ < h.degraded_loss * h.recovery && (h.degraded_rtt <= 0 || rtt_ < h.degraded_rtt * h.recovery);
+			if (over)
+				base = degraded;
+			else if (under)
+				base = up;
+		}
+
+		flap_score_ *= h.flap_decay;
+		if ((base == down) != (base_ == down))
+			flap_score_ += 1;
+		base_ = base;
+
+		state next = base_;
+		if (flap_score_ > h.flap_high || (state_ == flapping && flap_score_ >= h.flap_low))
+			next = flapping;
+
+		bool changed = next != state_;
+		state_ = next;
+		return changed;
+	}
+};
+
+inline std::ostream& operator<<(std::ostream& os, health_state::state s)
+{
+	static const char* names[] = { "up", "degraded", "down", "flapping" };
+	return os << names[s];
+}
+
+#endif // HEALTH_HPP
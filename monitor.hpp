@@ -0,0 +1,981 @@
+//
+// monitor.hpp : continuous monitoring of many targets on one socket and one timer
+// void monitor_ping(hex_ip4_addresses, count, interval_millisecond, slack_millisecond, report_stream)
+//
+
+#ifndef MONITOR_HPP
+#define MONITOR_HPP
+
+#include "ping.hpp"
+#include "alerts.hpp"
+#include "health.hpp"
+#include "probe_table.hpp"
+#include <algorithm>
+#include <bitset>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <random>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
+// Rate budget: up to burst probes at once, refilled at rate probes per second. A zero rate
+// is no limit at all.
+
+class token_bucket
+{
+private:
+	double rate_;
+	double burst_;
+	double tokens_;
+	chrono::steady_clock::time_point last_;
+
+public:
+	token_bucket(double rate = 0, double burst = 1) : rate_(rate), burst_(burst), tokens_(burst) {}
+
+	double rate() const { return rate_; }
+
+	void rate(double rate, double burst)
+	{
+		rate_ = rate;
+		burst_ = std::max(burst, 1.0);
+		tokens_ = std::min(tokens_, burst_);
+	}
+
+	void refill(chrono::steady_clock::time_point now)
+	{
+		if (rate_ > 0 && last_ != chrono::steady_clock::time_point())
+			tokens_ = std::min(burst_, tokens_ + rate_ * chrono::duration<double>(now - last_).count());
+		last_ = now;
+	}
+
+	bool available() const { return rate_ <= 0 || tokens_ >= 1; }
+
+	void take()
+	{
+		if (rate_ > 0)
+			tokens_ -= 1;
+	}
+
+	// Time until the next token, zero if there is one.
+	chrono::steady_clock::duration wait() const
+	{
+		if (available())
+			return chrono::steady_clock::duration::zero();
+		return chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>((1 - tokens_) / rate_))
+			+ chrono::steady_clock::duration(1);
+	}
+};
+
+// Additive increase, multiplicative decrease of a probe rate, once per epoch_.
+//
+// An epoch with a loss ratio above loss_threshold_, or with any send queue pressure, cuts
+// the rate by decrease_; an epoch without either, in which the rate held probes back, raises it
+// by increase_ probes per second. The rate never leaves [floor_, ceiling_] and starts at
+// floor_. An epoch with no demand beyond the rate leaves it alone, so a quiet spell does not
+// buy a burst later.
+
+class aimd_controller
+{
+private:
+	double rate_;
+	std::size_t replies_;
+	std::size_t losses_;
+	bool pressure_;
+	bool limited_;
+	chrono::steady_clock::time_point epoch_start_;
+
+public:
+	double floor_;
+	double ceiling_;
+	double increase_;
+	double decrease_;
+	double loss_threshold_;
+	chrono::milliseconds epoch_;
+
+	aimd_controller(double floor = 10, double ceiling = 1000)
+		: rate_(floor), replies_(0), losses_(0), pressure_(false), limited_(false),
+		floor_(floor), ceiling_(ceiling), increase_(10), decrease_(0.5), loss_threshold_(0.05), epoch_(1000)
+	{
+	}
+
+	double rate() const { return rate_; }
+
+	void start(chrono::steady_clock::time_point now)
+	{
+		rate_ = floor_;
+		epoch_start_ = now;
+	}
+
+	void replied() { ++replies_; }
+	void lost() { ++losses_; }
+	void pressure() { pressure_ = true; }
+	void limited() { limited_ = true; }
+
+	// Ends the epoch if it is over; true if the rate changed.
+	bool update(chrono::steady_clock::time_point now)
+	{
+		if (now - epoch_start_ < epoch_)
+			return false;
+
+		double rate = rate_;
+		std::size_t results = replies_ + losses_;
+		if (pressure_ || (results && losses_ > loss_threshold_ * results))
+			rate = std::max(floor_, rate_ * decrease_);
+		else if (limited_)
+			rate = std::min(ceiling_, rate_ + increase_);
+
+		replies_ = losses_ = 0;
+		pressure_ = limited_ = false;
+		epoch_start_ = now;
+
+		bool changed = rate != rate_;
+		rate_ = rate;
+		return changed;
+	}
+};
+
+// Recognizes ICMP rate limiting at a destination from its last 64 results.
+//
+//   - periodic drops: losses repeating every 2 to 16 probes between replies over the latest 32
+//     results and one period before them, the mark of a token bucket that refills slower than
+//     the probes drain it;
+//   - loss that rises with the rate: a loss ratio above loss_threshold_ with no period to it
+//     is measured again over a baseline of 64 fresh results, since the window that raised the
+//     suspicion overstates it, and if it holds the rate is halved for a trial of 64 results.
+//     The destination was rate limiting only if the trial loses half as many probes as the
+//     baseline or fewer, and the difference is more than three standard deviations; if not,
+//     the rate goes back.
+//
+// A rate-limited destination is probed at 1 / 2^shift() of the normal rate, halved again (down
+// to 1/16) whenever periodic drops come back; 64 results in a row without a loss buy one step
+// back up, and a full window that loses more than half as many as before the step costs the step.
+// Only losses while limited, and the one that gave periodic drops away, are marked: they say
+// nothing about whether the destination is reachable. Losses on baseline or trial count until
+// the trial confirms, and more than 16 losses in a row are never marked, so a rate-limited
+// destination that goes down is still seen going down.
+
+class rate_limit_detector
+{
+private:
+	enum state { normal, baseline, trial, limited };
+
+	uint64_t lost_;
+	std::size_t results_;
+	std::size_t marked_;
+	std::size_t losses_in_row_;
+	unsigned int shift_;
+	state state_;
+	std::size_t phase_losses_;
+	std::size_t baseline_losses_;
+	double loss_before_;
+
+	enum { phase_results = 64 };
+
+	std::size_t window() const { return std::min<std::size_t>(results_, 64); }
+	static uint64_t mask(std::size_t n) { return n >= 64 ? ~uint64_t(0) : (uint64_t(1) << n) - 1; }
+	std::size_t losses() const { return std::bitset<64>(lost_ & mask(window())).count(); }
+	double loss_ratio() const { return window() ? static_cast<double>(losses()) / window() : 0; }
+
+	// Bit 0 of lost_ is the latest result; a period p means the latest 32 results match the 32
+	// before them shifted by p, so older results from before the limiter kicked in do not count.
+	bool periodic() const
+	{
+		for (std::size_t p = 2; p <= 16 && 32 + p <= window(); ++p)
+		{
+			std::size_t l = std::bitset<64>(lost_ & mask(32 + p)).count();
+			if (l >= 3 && 2 * l <= 32 + p && (((lost_ >> p) ^ lost_) & mask(32)) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	// Results at the old rate say nothing about the new one.
+	void restart(state s)
+	{
+		state_ = s;
+		lost_ = 0;
+		results_ = 0;
+		phase_losses_ = 0;
+	}
+
+	// Steps up to a slower rate, remembering the loss it is meant to bring down.
+	void slow_down()
+	{
+		loss_before_ = loss_ratio();
+		++shift_;
+		restart(limited);
+	}
+
+public:
+	double loss_threshold_;
+
+	rate_limit_detector()
+		: lost_(0), results_(0), marked_(0), losses_in_row_(0), shift_(0), state_(normal), phase_losses_(0), baseline_losses_(0),
+		loss_before_(0), loss_threshold_(0.1)
+	{
+	}
+
+	unsigned int shift() const { return shift_; }
+	bool rate_limited() const { return state_ == limited; }
+	std::size_t marked() const { return marked_; }
+
+	// True if the result is a marked loss, one that should not count against the destination.
+	bool result(bool lost)
+	{
+		lost_ = (lost_ << 1) | (lost ? 1 : 0);
+		++results_;
+		losses_in_row_ = lost ? losses_in_row_ + 1 : 0;
+
+		// A rate limiter lets a reply through at least once per period; a longer run of losses
+		// is an outage, whatever the state.
+		bool excusable = lost && losses_in_row_ <= 16;
+		bool marked = excusable && state_ == limited;
+
+		switch (state_)
+		{
+		case normal:
+			if (!lost || shift_ >= 4)
+				break;
+			if (periodic())
+			{
+				marked = excusable;
+				slow_down();
+			}
+			else if (results_ >= 64 && losses() > loss_threshold_ * window() && 2 * losses() <= window())
+				restart(baseline);
+			break;
+
+		case baseline:
+			phase_losses_ += lost ? 1 : 0;
+			if (results_ < phase_results)
+				break;
+			if (phase_losses_ > loss_threshold_ * results_)
+			{
+				baseline_losses_ = phase_losses_;
+				++shift_;
+				restart(trial);
+			}
+			else
+				restart(normal);
+			break;
+
+		case trial:
+			phase_losses_ += lost ? 1 : 0;
+			if (results_ < phase_results)
+				break;
+			{
+				// Two counts of rare events: the variance of their difference is about their sum.
+				double difference = static_cast<double>(baseline_losses_) - static_cast<double>(phase_losses_);
+				if (2 * phase_losses_ <= baseline_losses_ && difference * difference > 9.0 * (baseline_losses_ + phase_losses_))
+				{
+					loss_before_ = static_cast<double>(baseline_losses_) / phase_results;
+					restart(limited);
+				}
+				else
+				{
+					--shift_;
+					restart(normal);
+				}
+			}
+			break;
+
+		case limited:
+			if (lost && shift_ < 4 && periodic())
+				slow_down();
+			else if (results_ >= 64 && 2 * losses() > loss_before_ * window())
+			{
+				// The loss is back above what the slower rate first brought it down to, so it is
+				// the path's, not a limiter's.
+				--shift_;
+				restart(shift_ ? limited : normal);
+			}
+			else if (!lost && results_ >= 64 && losses() == 0)
+			{
+				--shift_;
+				restart(shift_ ? limited : normal);
+			}
+			break;
+		}
+
+		if (marked)
+			++marked_;
+		return marked;
+	}
+};
+
+// monitor class
+//
+// Every target is probed once per interval_, on one socket, with one timer for all of them.
+// The timer only ever fires on multiples of slack_ (counted from the steady clock's epoch, so
+// that monitors in the same process share their slots too), and each wakeup serves every send
+// and every timeout that has come due: with a few hundred targets at 1 Hz and 100 ms of slack
+// the process wakes up at most 10 times a second instead of once per probe. No event happens
+// early; sends and loss verdicts are at most slack_ late, and RTTs, taken when replies arrive,
+// are not affected at all. A zero slack_ wakes up for every event.
+//
+// Probes not answered within timeout_ are lost; count_ probes per target, 0 for no end.
+//
+// Targets started together with the same interval would all fire in the same slot, a burst
+// that can overflow buffers on the way and show up as loss. schedule_ sets how the sends are
+// placed in time:
+//
+//   - lockstep: every target at the start of the interval;
+//   - spread (the default): target i at phase i / n of the interval, so the load is flat and
+//     the same targets always land in the same place;
+//   - poisson: exponentially distributed gaps with a mean of interval_, after a spread start
+//     (RFC 2330 Poisson sampling), so no periodic event on the network can line up with the
+//     samples. The gaps come from a generator seeded with seed_, so runs are repeatable.
+//
+// Each target belongs to a priority class: critical (the checks failover decisions hang on),
+// routine monitoring (the default) or background sweeps. The probes due in a wakeup are sent
+// class by class, and earliest deadline (the time the probe was due) first within a class.
+// Each class can have a rate budget of its own, and all of them share the total budget; a
+// probe with no budget left stays due and goes first in its class once tokens come back, so
+// a large background sweep can take whatever the critical checks leave, but never delay them.
+// expedite() makes a target due at once and wakes the monitor without waiting for a slot.
+//
+// With congestion_control() the total budget follows an aimd_controller fed with the losses
+// and replies of all targets and with send queue pressure: send errors for lack of buffer
+// space, and (on Linux) more than outq_limit_ bytes still queued in the socket at a wakeup.
+// Only a target's first loss in a row counts, so hosts that are simply down do not hold the
+// rate at the floor.
+//
+// Every target has a rate_limit_detector (unless rate_limit_detection_ is off): a destination
+// found limiting ICMP replies is probed more slowly, and its marked losses are reported apart
+// from the ones that count against it: they are left out of its health, its alerts and its
+// loss ratio, which is over the probes sent less the marked losses.
+//
+// Every result also goes to the target's health_state, with the thresholds in health_, and a
+// change of state calls on_health_change_(target, from, to); nothing is called otherwise.
+// The rules added to alerts_ before start() are evaluated on every result as well.
+//
+// Targets filter_ refuses at start() are never probed.
+//
+// Targets can depend on a parent (depends_on(), or infer_dependencies() for subnets). While a
+// parent is down by its health, or one of its own parents is, its dependents are not probed at
+// all (suppress) or only every dependency_slowdown_-th time (slow), and the rounds they skip
+// count towards count_. Parents go first among the probes of their class, and when one
+// recovers its dependents are probed again at the next slot.
+//
+// With adaptive() each target has an interval of its own between a floor and a ceiling. It
+// doubles after stable_after_ results in a row that agree (all replies, or all losses), so a
+// target that never changes costs less and less; a single result against the trend halves it,
+// and two in a row, a change of state, drop it to the floor at once. The asymmetry is the
+// hysteresis: slow to trust a target, quick to look closer. The next probe is pulled forward
+// whenever the interval shrinks.
+
+class monitor
+{
+private:
+	struct target
+	{
+		icmp::endpoint destination;
+		chrono::steady_clock::time_point next_send;
+		std::size_t sent;
+		probe_statistics statistics;
+		unsigned char priority;
+		health_state health;
+		rate_limit_detector rate_limit;
+		std::size_t parent;
+		bool is_parent;
+		std::size_t skipped;
+		std::size_t held;
+		uint32_t interval;
+		std::size_t agreeing;
+		std::size_t contrary;
+		bool last_replied;
+		bool excluded;
+	};
+
+	struct sent_probe
+	{
+		unsigned short sequence_number;
+		chrono::steady_clock::time_point time_sent;
+	};
+
+	icmp::socket socket_;
+	steady_timer timer_;
+	boost::asio::streambuf reply_buffer_;
+	std::vector<target> targets_;
+	probe_table outstanding_;
+	std::deque<sent_probe> in_flight_;
+	unsigned char request_header_[8];
+	unsigned short sequence_number_;
+	std::size_t wakeups_;
+	std::size_t deferred_;
+	std::size_t suppressed_;
+	address_set addresses_;
+	std::size_t misdirected_;
+	std::size_t spoofed_;
+	std::minstd_rand random_;
+	token_bucket class_budgets_[3];
+	token_bucket total_budget_;
+	std::vector<std::size_t> due_;
+	chrono::steady_clock::time_point retry_;
+	aimd_controller congestion_;
+	bool congestion_control_;
+
+	// Sequence numbers are unique among the probes out, so they alone key outstanding_, which
+	// has room for all 65536 of them; the source of a reply is checked against the target after.
+	static uint64_t probe_key(unsigned short sequence_number)
+	{
+		return probe_table::key(boost::asio::ip::address_v4(), pinger::get_identifier(), sequence_number);
+	}
+
+	// Probes go out in time order, so in_flight_ holds them oldest first, and the answered ones
+	// are only dropped once they reach the front; a wakeup never has to look past the probes it
+	// expires. An entry whose send time differs from the table's is a sequence number since
+	// reused. False if no probe is out.
+	bool oldest(chrono::steady_clock::time_point& time_sent, uint32_t& index)
+	{
+		for (; !in_flight_.empty(); in_flight_.pop_front())
+			if (outstanding_.find(probe_key(in_flight_.front().sequence_number), time_sent, index) && time_sent == in_flight_.front().time_sent)
+				return true;
+		return false;
+	}
+
+	chrono::steady_clock::duration gap(const target& t)
+	{
+		chrono::steady_clock::duration interval = chrono::milliseconds(static_cast<uint64_t>(adaptive_ ? t.interval : interval_) << t.rate_limit.shift());
+		if (schedule_ != poisson)
+			return interval;
+		std::exponential_distribution<double> exponential(1.0);
+		return chrono::duration_cast<chrono::steady_clock::duration>(interval * exponential(random_));
+	}
+
+	void send(std::size_t index, chrono::steady_clock::time_point now)
+	{
+		std::string body("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+
+		icmp_header echo_request;
+		echo_request.type(icmp_header::echo_request);
+		echo_request.code(0);
+		echo_request.identifier(pinger::get_identifier());
+		echo_request.sequence_number(++sequence_number_);
+		compute_checksum(echo_request, body.begin(), body.end());
+		echo_request.write(request_header_);
+
+		std::array<boost::asio::const_buffer, 2> request = { { boost::asio::buffer(request_header_), boost::asio::buffer(body) } };
+
+		target& t = targets_[index];
+		outstanding_.insert(probe_key(sequence_number_), now, static_cast<uint32_t>(index));
+		sent_probe probe = { sequence_number_, now };
+		in_flight_.push_back(probe);
+		t.statistics.add_sent();
+		++t.sent;
+
+		// A send error (no route, say) is a lost probe, not the end of the monitor.
+		boost::system::error_code error;
+		socket_.send_to(request, t.destination, 0, error);
+		if (error == boost::asio::error::no_buffer_space || error == boost::asio::error::would_block)
+			congestion_.pressure();
+	}
+
+	// Feeds a result to the target's health and reports a change of state.
+	void assess(std::size_t index, bool replied, double rtt)
+	{
+		target& t = targets_[index];
+		health_state::state before = t.health.current();
+		if (t.health.update(health_, replied, rtt) && on_health_change_)
+			on_health_change_(index, before, t.health.current());
+		if (!alerts_.empty())
+			alerts_.result(index, replied, rtt);
+	}
+
+	void lost(std::size_t index, chrono::steady_clock::time_point now)
+	{
+		target& t = targets_[index];
+
+		// A marked loss is the destination's rate limiter, not the path: it stays out of health,
+		// alerts, the loss ratio, congestion control and the adaptive interval.
+		if (rate_limit_detection_ && t.rate_limit.result(true))
+		{
+			t.statistics.discount();
+			return;
+		}
+
+		assess(index, false, 0);
+		if (t.health.losses_in_row() == 1)
+			congestion_.lost();
+		if (adaptive_)
+			adapt(t, false, now);
+	}
+
+	void adapt(target& t, bool replied, chrono::steady_clock::time_point now)
+	{
+		uint32_t interval = t.interval;
+		if (replied == t.last_replied)
+		{
+			t.contrary = 0;
+			if (++t.agreeing >= stable_after_)
+			{
+				t.agreeing = 0;
+				interval = std::min(ceiling_, interval * 2);
+			}
+		}
+		else
+		{
+			t.agreeing = 0;
+			if (++t.contrary >= 2)
+			{
+				t.contrary = 0;
+				t.last_replied = replied;
+				interval = floor_;
+			}
+			else
+				interval = std::max(floor_, interval / 2);
+		}
+
+		if (interval < t.interval)
+			t.next_send = std::min(t.next_send, now + chrono::milliseconds(interval));
+		t.interval = interval;
+	}
+
+	void update_congestion(chrono::steady_clock::time_point now)
+	{
+#if defined(__linux__)
+		int queued = 0;
+		if (::ioctl(socket_.native_handle(), SIOCOUTQ, &queued) == 0 && static_cast<std::size_t>(queued) > outq_limit_)
+			congestion_.pressure();
+#endif
+		// A slot's worth of probes may go out together.
+		if (congestion_.update(now))
+			total_budget_.rate(congestion_.rate(), congestion_.rate() * slack_ / 1000);
+	}
+
+	bool done(const target& t) const { return t.excluded || (count_ && t.sent + t.skipped >= count_); }
+
+	bool down(const target& t) const { return t.health.is_down(); }
+
+	// True if some parent up the chain is down; the depth bound keeps a cycle from hanging us.
+	bool blocked(const target& t) const
+	{
+		std::size_t parent = t.parent;
+		for (std::size_t depth = 0; parent != no_parent && depth < 16; ++depth)
+		{
+			if (down(targets_[parent]))
+				return true;
+			parent = targets_[parent].parent;
+		}
+		return false;
+	}
+
+	// Stay on the target's own schedule unless a whole gap was missed.
+	void advance(target& t, chrono::steady_clock::time_point now)
+	{
+		chrono::steady_clock::duration g = gap(t);
+		t.next_send += g;
+		if (t.next_send <= now)
+			t.next_send = now + g;
+	}
+
+	void wakeup()
+	{
+		chrono::steady_clock::time_point now = steady_timer::clock_type::now();
+		++wakeups_;
+
+		// Timeouts first: a probe sent in this batch must not be expired by it.
+		chrono::steady_clock::time_point deadline = now - chrono::milliseconds(timeout_) + chrono::steady_clock::duration(1);
+		chrono::steady_clock::time_point time_sent;
+		uint32_t index;
+		while (oldest(time_sent, index) && time_sent < deadline)
+		{
+			outstanding_.take(probe_key(in_flight_.front().sequence_number), time_sent);
+			in_flight_.pop_front();
+			lost(index, now);
+		}
+
+		due_.clear();
+		for (std::size_t i = 0; i < targets_.size(); ++i)
+			if (!done(targets_[i]) && targets_[i].next_send <= now)
+				due_.push_back(i);
+		std::sort(due_.begin(), due_.end(), [this](std::size_t a, std::size_t b)
+			{
+				const target& x = targets_[a];
+				const target& y = targets_[b];
+				if (x.priority != y.priority)
+					return x.priority < y.priority;
+				if (x.is_parent != y.is_parent)
+					return x.is_parent;
+				return x.next_send < y.next_send;
+			});
+
+		if (congestion_control_)
+			update_congestion(now);
+
+		total_budget_.refill(now);
+		for (std::size_t c = 0; c < 3; ++c)
+			class_budgets_[c].refill(now);
+
+		// Probes left without budget are retried as soon as their budgets have a token again.
+		retry_ = now;
+		chrono::steady_clock::duration retry = chrono::steady_clock::duration::max();
+		for (std::size_t i = 0; i < due_.size(); ++i)
+		{
+			target& t = targets_[due_[i]];
+			// In slow mode every dependency_slowdown_-th round of a blocked target still goes out.
+			if (blocked(t) && (dependency_mode_ == suppress || ++t.held % dependency_slowdown_ != 0))
+			{
+				++t.skipped;
+				++suppressed_;
+				advance(t, now);
+				continue;
+			}
+
+			token_bucket& budget = class_budgets_[t.priority];
+			if (!budget.available() || !total_budget_.available())
+			{
+				++deferred_;
+				if (!total_budget_.available())
+					congestion_.limited();
+				retry = std::min(retry, std::max(budget.wait(), total_budget_.wait()));
+				continue;
+			}
+			budget.take();
+			total_budget_.take();
+
+			send(due_[i], now);
+			advance(t, now);
+		}
+		if (retry != chrono::steady_clock::duration::max())
+			retry_ = now + retry;
+
+		schedule();
+	}
+
+	// Arms the timer for the first slot boundary at or after the next event.
+	void schedule()
+	{
+		bool pending = false;
+		chrono::steady_clock::time_point next = chrono::steady_clock::time_point::max();
+		for (std::size_t i = 0; i < targets_.size(); ++i)
+		{
+			if (done(targets_[i]))
+				continue;
+			pending = true;
+			next = std::min(next, std::max(targets_[i].next_send, retry_));
+		}
+		chrono::steady_clock::time_point time_sent;
+		uint32_t index;
+		if (oldest(time_sent, index))
+		{
+			pending = true;
+			next = std::min(next, time_sent + chrono::milliseconds(timeout_));
+		}
+
+		if (!pending)
+		{
+			socket_.close();
+			return;
+		}
+
+		if (slack_ > 0)
+		{
+			chrono::steady_clock::duration slot = chrono::milliseconds(slack_);
+			chrono::steady_clock::duration since_epoch = next.time_since_epoch() + slot - chrono::steady_clock::duration(1);
+			next = chrono::steady_clock::time_point(since_epoch - since_epoch % slot);
+		}
+
+		timer_.expires_at(next);
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_timeout lambda
+				if (!error)
+					wakeup();
+			});
+	}
+
+public:
+	enum schedule_kind { lockstep, spread, poisson };
+
+	std::size_t count_;
+	uint16_t interval_;
+	uint16_t timeout_;
+	uint16_t slack_;
+	schedule_kind schedule_;
+	unsigned int seed_;
+
+	enum priority_class { critical, routine, background };
+	enum dependency_kind { suppress, slow };
+	static const std::size_t no_parent = static_cast<std::size_t>(-1);
+
+	std::size_t outq_limit_;
+	bool rate_limit_detection_;
+	health_thresholds health_;
+	std::function<void(std::size_t, health_state::state, health_state::state)> on_health_change_;
+	alert_rules alerts_;
+	dependency_kind dependency_mode_;
+	std::size_t dependency_slowdown_;
+	bool adaptive_;
+	uint32_t floor_;
+	uint32_t ceiling_;
+	std::size_t stable_after_;
+	const target_filter* filter_;
+	checksum_verifier checksums_;
+
+	monitor(boost::asio::io_context& ping_io_context, const std::vector<boost::asio::ip::address_v4>& targets)
+		: socket_(ping_io_context, icmp::v4()), timer_(ping_io_context), outstanding_(65536), sequence_number_(0), wakeups_(0), deferred_(0), suppressed_(0), misdirected_(0), spoofed_(0), congestion_control_(false),
+		count_(0), interval_(1000), timeout_(1000), slack_(100), schedule_(spread), seed_(1), outq_limit_(65536), rate_limit_detection_(true),
+		dependency_mode_(suppress), dependency_slowdown_(8),
+		adaptive_(false), floor_(1000), ceiling_(60000), stable_after_(10), filter_(0)
+	{
+		for (std::size_t i = 0; i < targets.size(); ++i)
+		{
+			target t = { icmp::endpoint(targets[i], 0), chrono::steady_clock::time_point(), 0, probe_statistics(), routine, health_state(), rate_limit_detector(), no_parent, false, 0, 0, 0, 0, 0, true, false };
+			targets_.push_back(t);
+			addresses_.insert(targets[i]);
+		}
+	}
+
+	void priority(std::size_t target, priority_class c) { targets_[target].priority = static_cast<unsigned char>(c); }
+
+	// Per-target intervals between floor and ceiling milliseconds, starting from interval_.
+	void adaptive(uint32_t floor, uint32_t ceiling)
+	{
+		adaptive_ = true;
+		floor_ = floor;
+		ceiling_ = std::max(floor, ceiling);
+		for (std::size_t i = 0; i < targets_.size(); ++i)
+			targets_[i].interval = std::min(ceiling_, std::max<uint32_t>(floor_, interval_));
+	}
+
+	uint32_t interval(std::size_t target) const { return adaptive_ ? targets_[target].interval : interval_; }
+
+	void depends_on(std::size_t target, std::size_t parent)
+	{
+		targets_[target].parent = parent;
+		targets_[parent].is_parent = true;
+	}
+
+	// Makes every target depend on the lowest address of its /prefix_length subnet among the
+	// targets, which is where the gateway usually sits.
+	void infer_dependencies(unsigned int prefix_length = 24)
+	{
+		uint32_t mask = prefix_length ? ~uint32_t(0) << (32 - std::min(prefix_length, 32u)) : 0;
+		std::map<uint32_t, std::size_t> gateways;
+		for (std::size_t i = 0; i < targets_.size(); ++i)
+		{
+			uint32_t address = targets_[i].destination.address().to_v4().to_uint();
+			std::map<uint32_t, std::size_t>::iterator it = gateways.find(address & mask);
+			if (it == gateways.end())
+				gateways[address & mask] = i;
+			else if (address < targets_[it->second].destination.address().to_v4().to_uint())
+				it->second = i;
+		}
+		for (std::size_t i = 0; i < targets_.size(); ++i)
+		{
+			std::size_t gateway = gateways[targets_[i].destination.address().to_v4().to_uint() & mask];
+			if (gateway != i)
+				depends_on(i, gateway);
+		}
+	}
+
+	// Probes per second for one class, or for all of them together; 0 for no limit.
+	void class_budget(priority_class c, double rate, double burst = 1) { class_budgets_[c].rate(rate, burst); }
+	void total_budget(double rate, double burst = 1) { total_budget_.rate(rate, burst); }
+
+	// Lets an aimd_controller set the total budget between floor and ceiling probes per second;
+	// congestion() tunes it further before start().
+	void congestion_control(double floor, double ceiling)
+	{
+		congestion_control_ = true;
+		congestion_.floor_ = floor;
+		congestion_.ceiling_ = ceiling;
+	}
+
+	aimd_controller& congestion() { return congestion_; }
+
+	void expedite(std::size_t target)
+	{
+		chrono::steady_clock::time_point now = steady_timer::clock_type::now();
+		targets_[target].next_send = now;
+		retry_ = now;
+		timer_.expires_at(now);
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_timeout lambda
+				if (!error)
+					wakeup();
+			});
+	}
+
+	void start()
+	{
+		random_.seed(seed_);
+		alerts_.compile(targets_.size());
+
+		chrono::steady_clock::time_point now = steady_timer::clock_type::now();
+		if (congestion_control_)
+		{
+			congestion_.start(now);
+			total_budget_.rate(congestion_.rate(), congestion_.rate() * slack_ / 1000);
+		}
+		for (std::size_t i = 0; i < targets_.size(); ++i)
+		{
+			targets_[i].next_send = now;
+			targets_[i].excluded = filter_ && !filter_->permits(targets_[i].destination.address());
+			if (schedule_ != lockstep)
+				targets_[i].next_send += chrono::milliseconds(interval_) * i / targets_.size();
+		}
+
+		wakeup();
+		start_receive();
+	}
+
+	void handle_reply(const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr)
+	{
+		if (icmp_hdr.type() != icmp_header::echo_reply || icmp_hdr.identifier() != pinger::get_identifier())
+			return;
+
+		uint64_t key = probe_key(icmp_hdr.sequence_number());
+		chrono::steady_clock::time_point time_sent;
+		uint32_t index;
+		if (!outstanding_.take(key, time_sent, index))
+			return;
+
+		target& t = targets_[index];
+		if (ipv4_hdr.source_address() != t.destination.address().to_v4())
+		{
+			// The probe is still waiting for its own reply.
+			outstanding_.insert(key, time_sent, index);
+			if (addresses_.contains(ipv4_hdr.source_address()))
+				++misdirected_;
+			else
+				++spoofed_;
+			return;
+		}
+
+		chrono::steady_clock::time_point now = steady_timer::clock_type::now();
+		t.statistics.add_reply(now - time_sent);
+		bool was_down = down(t);
+		assess(index, true, chrono::duration<double, std::milli>(now - time_sent).count());
+		bool recovered = was_down && !down(t);
+		congestion_.replied();
+		if (rate_limit_detection_)
+			t.rate_limit.result(false);
+		if (adaptive_)
+			adapt(t, true, now);
+
+		if (recovered && t.is_parent)
+		{
+			for (std::size_t i = 0; i < targets_.size(); ++i)
+				if (targets_[i].parent == index && !blocked(targets_[i]))
+					targets_[i].next_send = std::min(targets_[i].next_send, now);
+			schedule();
+		}
+	}
+
+	void start_receive()
+	{
+		reply_buffer_.consume(reply_buffer_.size());
+
+		socket_.async_receive(reply_buffer_.prepare(1024), [this](const boost::system::error_code& error, std::size_t bytes_transferred)
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				reply_buffer_.commit(bytes_transferred);
+
+				if (checksums_.verify_icmp(static_cast<const unsigned char*>(reply_buffer_.data().data()), bytes_transferred, 1024))
+				{
+					std::istream is(&reply_buffer_);
+					ipv4_header ipv4_hdr;
+					icmp_header icmp_hdr;
+					is >> ipv4_hdr >> icmp_hdr;
+
+					if (is)
+						handle_reply(ipv4_hdr, icmp_hdr);
+				}
+
+				start_receive();
+			});
+	}
+
+	std::size_t targets() const { return targets_.size(); }
+	const probe_statistics& statistics(std::size_t target) const { return targets_[target].statistics; }
+	const rate_limit_detector& rate_limit(std::size_t target) const { return targets_[target].rate_limit; }
+	const health_state& health(std::size_t target) const { return targets_[target].health; }
+
+	// Timer expirations so far, the figure slack_ is there to keep down.
+	std::size_t wakeups() const { return wakeups_; }
+
+	// Due probes held back by a rate budget, once per wakeup they waited through.
+	std::size_t deferred() const { return deferred_; }
+
+	// Rounds skipped because a parent was down.
+	std::size_t suppressed() const { return suppressed_; }
+
+	// Replies to an outstanding probe from another of the targets, and from an address that is
+	// none of them; neither counts as a reply.
+	std::size_t misdirected() const { return misdirected_; }
+	std::size_t spoofed() const { return spoofed_; }
+
+	bool excluded(std::size_t target) const { return targets_[target].excluded; }
+
+	void report(std::ostream& os) const
+	{
+		os << std::fixed << std::setprecision(3);
+		for (std::size_t i = 0; i < targets_.size(); ++i)
+		{
+			if (targets_[i].excluded)
+			{
+				os << " " << targets_[i].destination.address().to_string() << ": excluded\n";
+				continue;
+			}
+			const probe_statistics& s = targets_[i].statistics;
+			os << " " << targets_[i].destination.address().to_string()
+				<< ": " << targets_[i].health.current() << ", sent " << targets_[i].sent << ", received " << s.received()
+				<< ", loss " << s.loss() * 100 << "%, rtt " << s.mean_rtt() << "/" << s.stddev_rtt() << " msec";
+			if (adaptive_)
+				os << ", every " << targets_[i].interval << " msec";
+			const rate_limit_detector& r = targets_[i].rate_limit;
+			if (r.marked() || r.shift())
+				os << ", " << r.marked() << " losses to rate limiting, rate 1/" << (1 << r.shift());
+			os << "\n";
+		}
+		os << " wakeups " << wakeups_ << ", deferred " << deferred_ << ", suppressed " << suppressed_;
+		if (misdirected_ || spoofed_)
+			os << ", misdirected " << misdirected_ << ", spoofed " << spoofed_;
+		if (checksums_.corrupted())
+			os << ", corrupted " << checksums_.corrupted();
+		if (congestion_control_)
+			os << ", rate " << congestion_.rate() << "/s";
+		os << "\n";
+	}
+};
+
+void monitor_ping(const std::vector<uint32_t>& addresses, std::size_t count, uint16_t interval_milliseconds,
+	uint16_t slack_milliseconds, std::ostream& os)
+{
+	boost::asio::io_context ping_io_context;
+
+	std::vector<boost::asio::ip::address_v4> targets;
+	for (std::size_t i = 0; i < addresses.size(); ++i)
+		targets.push_back(boost::asio::ip::address_v4(addresses[i]));
+
+	try
+	{
+		monitor m(ping_io_context, targets);
+		m.count_ = count;
+		m.interval_ = interval_milliseconds;
+		m.slack_ = slack_milliseconds;
+
+		m.start();
+
+		ping_io_context.run();
+
+		m.report(os);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+}
+
+#endif // MONITOR_HPP
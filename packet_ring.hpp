@@ -0,0 +1,628 @@
+//
+// packet_ring.hpp : memory-mapped AF_PACKET rings for high-rate ping sweeps (Linux only)
+// bool ping_mmap(hex_ip4_address, count, timer_millisecond)
+//
+
+#ifndef PACKET_RING_HPP
+#define PACKET_RING_HPP
+
+#include "ping.hpp"
+#include "probe_table.hpp"
+
+#if defined(__linux__)
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+inline void throw_errno(const char* what)
+{
+	throw boost::system::system_error(boost::system::error_code(errno, boost::system::system_category()), what);
+}
+
+typedef std::array<unsigned char, 6> mac_address;
+
+inline int interface_request(const std::string& interface_name, unsigned long request, ifreq& ifr)
+{
+	std::fill(reinterpret_cast<char*>(&ifr), reinterpret_cast<char*>(&ifr) + sizeof(ifr), 0);
+	interface_name.copy(ifr.ifr_name, IFNAMSIZ - 1);
+	ifr.ifr_addr.sa_family = AF_INET;
+
+	int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	int result = ::ioctl(fd, request, &ifr);
+	::close(fd);
+	return result;
+}
+
+inline mac_address interface_mac(const std::string& interface_name)
+{
+	ifreq ifr;
+	if (interface_request(interface_name, SIOCGIFHWADDR, ifr) < 0)
+		throw_errno("SIOCGIFHWADDR");
+	mac_address mac;
+	std::copy(ifr.ifr_hwaddr.sa_data, ifr.ifr_hwaddr.sa_data + 6, mac.begin());
+	return mac;
+}
+
+inline boost::asio::ip::address_v4 interface_address(const std::string& interface_name)
+{
+	ifreq ifr;
+	if (interface_request(interface_name, SIOCGIFADDR, ifr) < 0)
+		throw_errno("SIOCGIFADDR");
+	return boost::asio::ip::address_v4(ntohl(reinterpret_cast<sockaddr_in*>(&ifr.ifr_addr)->sin_addr.s_addr));
+}
+
+// Receive ring for ICMP echo replies.
+//
+// The kernel writes matching packets into the blocks of a TPACKET_V3 ring shared with us, so
+// replies are parsed in place, one block at a time, instead of being received one by one into
+// a streambuf. A block is handed to us when it fills up or when retire_timeout milliseconds
+// have passed since its first packet, so keep that well below the interval between probes.
+//
+// A BPF filter on the socket lets through unfragmented ICMP echo replies with our identifier
+// only, everything else is dropped in the kernel before it is copied.
+
+class packet_rx_ring
+{
+private:
+	boost::asio::posix::stream_descriptor descriptor_;
+	unsigned char* ring_;
+	tpacket_req3 req_;
+	unsigned int current_block_;
+
+	void attach_filter(unsigned short identifier)
+	{
+		// Cooked (SOCK_DGRAM) packets start at the IPv4 header.
+		sock_filter code[] = {
+			{ BPF_LD | BPF_B | BPF_ABS, 0, 0, 9 },					// A = protocol
+			{ BPF_JMP | BPF_JEQ | BPF_K, 0, 8, IPPROTO_ICMP },
+			{ BPF_LD | BPF_H | BPF_ABS, 0, 0, 6 },					// A = flags and fragment offset
+			{ BPF_JMP | BPF_JSET | BPF_K, 6, 0, 0x1FFF },
+			{ BPF_LDX | BPF_B | BPF_MSH, 0, 0, 0 },					// X = header length
+			{ BPF_LD | BPF_B | BPF_IND, 0, 0, 0 },					// A = ICMP type
+			{ BPF_JMP | BPF_JEQ | BPF_K, 0, 3, icmp_header::echo_reply },
+			{ BPF_LD | BPF_H | BPF_IND, 0, 0, 4 },					// A = ICMP identifier
+			{ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, identifier },
+			{ BPF_RET | BPF_K, 0, 0, 0xFFFF },
+			{ BPF_RET | BPF_K, 0, 0, 0 }
+		};
+		sock_fprog program = { static_cast<unsigned short>(sizeof(code) / sizeof(code[0])), code };
+
+		if (::setsockopt(descriptor_.native_handle(), SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0)
+			throw_errno("SO_ATTACH_FILTER");
+	}
+
+public:
+	// Frames taken from the ring have not been through the IP layer's checks yet.
+	checksum_verifier checksums_;
+
+	packet_rx_ring(boost::asio::io_context& ring_io_context, unsigned short identifier,
+		const std::string& interface_name = std::string(),
+		unsigned int block_size = 1 << 20, unsigned int block_count = 64,
+		unsigned int frame_size = 2048, unsigned int retire_timeout = 4)
+		: descriptor_(ring_io_context), ring_(0), current_block_(0)
+	{
+		// Open the socket without a protocol so that nothing is queued before the filter is in place.
+		int fd = ::socket(AF_PACKET, SOCK_DGRAM, 0);
+		if (fd < 0)
+			throw_errno("AF_PACKET socket");
+		descriptor_.assign(fd);
+
+		int version = TPACKET_V3;
+		if (::setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+			throw_errno("PACKET_VERSION");
+
+		attach_filter(identifier);
+
+		std::fill(reinterpret_cast<char*>(&req_), reinterpret_cast<char*>(&req_) + sizeof(req_), 0);
+		req_.tp_block_size = block_size;
+		req_.tp_block_nr = block_count;
+		req_.tp_frame_size = frame_size;
+		req_.tp_frame_nr = (block_size / frame_size) * block_count;
+		req_.tp_retire_blk_tov = retire_timeout;
+		if (::setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req_, sizeof(req_)) < 0)
+			throw_errno("PACKET_RX_RING");
+
+		void* ring = ::mmap(0, static_cast<std::size_t>(block_size) * block_count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+		if (ring == MAP_FAILED)
+			throw_errno("mmap");
+		ring_ = static_cast<unsigned char*>(ring);
+
+		sockaddr_ll address;
+		std::fill(reinterpret_cast<char*>(&address), reinterpret_cast<char*>(&address) + sizeof(address), 0);
+		address.sll_family = AF_PACKET;
+		address.sll_protocol = htons(ETH_P_IP);
+		address.sll_ifindex = interface_name.empty() ? 0 : ::if_nametoindex(interface_name.c_str());
+		if (!interface_name.empty() && address.sll_ifindex == 0)
+			throw_errno("if_nametoindex");
+		if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+			throw_errno("AF_PACKET bind");
+	}
+
+	~packet_rx_ring()
+	{
+		if (ring_)
+			::munmap(ring_, static_cast<std::size_t>(req_.tp_block_size) * req_.tp_block_nr);
+	}
+
+	packet_rx_ring(const packet_rx_ring&) = delete;
+	packet_rx_ring& operator=(const packet_rx_ring&) = delete;
+
+	int native_handle() { return descriptor_.native_handle(); }
+
+	void close() { descriptor_.close(); }
+
+	// Spreads replies over every ring that joined the same group, by flow hash
+	// (PACKET_FANOUT_HASH) or by the CPU that received them (PACKET_FANOUT_CPU).
+	void join_fanout(unsigned short group_id, unsigned short mode = PACKET_FANOUT_HASH)
+	{
+		int fanout = group_id | (mode << 16);
+		if (::setsockopt(descriptor_.native_handle(), SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0)
+			throw_errno("PACKET_FANOUT");
+	}
+
+	// Walks every block the kernel has handed over, calls handler(ipv4_hdr, icmp_hdr) for each
+	// reply in it and gives the block back. Returns the number of replies seen; never blocks.
+	template <typename Handler>
+	std::size_t poll(Handler& handler)
+	{
+		std::size_t replies = 0;
+
+		for (;;)
+		{
+			tpacket_block_desc* block = reinterpret_cast<tpacket_block_desc*>(ring_ + static_cast<std::size_t>(current_block_) * req_.tp_block_size);
+			if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+				break;
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			const unsigned char* frame = reinterpret_cast<const unsigned char*>(block) + block->hdr.bh1.offset_to_first_pkt;
+			for (unsigned int i = 0; i < block->hdr.bh1.num_pkts; ++i)
+			{
+				const tpacket3_hdr* packet = reinterpret_cast<const tpacket3_hdr*>(frame);
+				const sockaddr_ll* link = reinterpret_cast<const sockaddr_ll*>(frame + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+				// Replies to ourselves over loopback are seen on the way out as well.
+				const unsigned char* data = frame + packet->tp_net;
+				ipv4_header ipv4_hdr;
+				icmp_header icmp_hdr;
+				if (link->sll_pkttype != PACKET_OUTGOING
+					&& checksums_.verify(data, packet->tp_snaplen)
+					&& ipv4_hdr.parse(data, packet->tp_snaplen)
+					&& icmp_hdr.parse(data + ipv4_hdr.header_length(), packet->tp_snaplen - ipv4_hdr.header_length()))
+				{
+					handler(ipv4_hdr, icmp_hdr);
+					++replies;
+				}
+
+				frame += packet->tp_next_offset;
+			}
+
+			std::atomic_thread_fence(std::memory_order_release);
+			block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+			current_block_ = (current_block_ + 1) % req_.tp_block_nr;
+		}
+
+		return replies;
+	}
+
+	// Keeps handing replies to handler(ipv4_hdr, icmp_hdr) as blocks are retired, until the ring is closed.
+	template <typename Handler>
+	void async_receive(Handler handler)
+	{
+		descriptor_.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this, handler](const boost::system::error_code& error) mutable
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				poll(handler);
+				async_receive(handler);
+			});
+	}
+};
+
+// Ethernet/IPv4/ICMP echo request frame.
+//
+// The frame is built once from an IPv4 header template, an icmp_header and the body, so that
+// a probe only patches the destination address, the sequence number (also used as IP
+// identification) and the two checksums while it is written into a transmit slot.
+
+class echo_frame
+{
+private:
+	enum { ethernet_length = 14 };
+
+	std::vector<unsigned char> rep_;
+	std::size_t icmp_offset_;
+	icmp_header echo_request_;
+
+public:
+	echo_frame(const mac_address& source_mac, const mac_address& next_hop_mac,
+		boost::asio::ip::address_v4 source, unsigned short identifier,
+		const std::string& body = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+		const ipv4_header& ip_template = icmp_ipv4_template())
+	{
+		ipv4_header ipv4_hdr = ip_template;
+		icmp_offset_ = ethernet_length + ipv4_hdr.header_length();
+		rep_.assign(icmp_offset_ + 8 + body.size(), 0);
+
+		unsigned char* ethernet = &rep_[0];
+		std::copy(next_hop_mac.begin(), next_hop_mac.end(), ethernet);
+		std::copy(source_mac.begin(), source_mac.end(), ethernet + 6);
+		ethernet[12] = ETH_P_IP >> 8;
+		ethernet[13] = ETH_P_IP & 0xFF;
+
+		ipv4_hdr.total_length(static_cast<unsigned short>(rep_.size() - ethernet_length));
+		ipv4_hdr.protocol(IPPROTO_ICMP);
+		ipv4_hdr.source_address(source);
+		// write() sums the header as it stands, so a checksum left in the template must go.
+		ipv4_hdr.header_checksum(0);
+		ipv4_hdr.write(ethernet + ethernet_length);
+
+		echo_request_.type(icmp_header::echo_request);
+		echo_request_.code(0);
+		echo_request_.identifier(identifier);
+		std::copy(body.begin(), body.end(), &rep_[icmp_offset_ + 8]);
+	}
+
+	std::size_t size() const { return rep_.size(); }
+
+	void write(unsigned char* data, boost::asio::ip::address_v4 destination, unsigned short sequence_number) const
+	{
+		std::copy(rep_.begin(), rep_.end(), data);
+
+		unsigned char* ip = data + ethernet_length;
+		boost::asio::ip::address_v4::bytes_type destination_bytes = destination.to_bytes();
+		std::copy(destination_bytes.begin(), destination_bytes.end(), ip + 16);
+		ip[4] = static_cast<unsigned char>(sequence_number >> 8);
+		ip[5] = static_cast<unsigned char>(sequence_number & 0xFF);
+		unsigned short ip_checksum = internet_checksum(ip, icmp_offset_ - ethernet_length);
+		ip[10] = static_cast<unsigned char>(ip_checksum >> 8);
+		ip[11] = static_cast<unsigned char>(ip_checksum & 0xFF);
+
+		icmp_header echo_request = echo_request_;
+		echo_request.sequence_number(sequence_number);
+		echo_request.write(data + icmp_offset_);
+		echo_request.checksum(internet_checksum(data + icmp_offset_, rep_.size() - icmp_offset_));
+		echo_request.write(data + icmp_offset_);
+	}
+};
+
+// Transmit ring for echo request frames.
+//
+// Frames are written straight into the slots of a TPACKET_V2 ring shared with the kernel and
+// marked ready; flush() then sends every ready slot with a single system call instead of one
+// send_to per probe. The frames carry their own Ethernet header, so the next hop MAC has to be
+// known up front (the gateway's, or the peer's on a veth pair).
+
+class packet_tx_ring
+{
+private:
+	boost::asio::posix::stream_descriptor descriptor_;
+	unsigned char* ring_;
+	tpacket_req req_;
+	unsigned int current_frame_;
+	std::size_t pending_;
+	sockaddr_ll address_;
+
+	tpacket2_hdr* slot(unsigned int index)
+	{
+		return reinterpret_cast<tpacket2_hdr*>(ring_ + static_cast<std::size_t>(index) * req_.tp_frame_size);
+	}
+
+	static unsigned int status(const tpacket2_hdr* header)
+	{
+		return *static_cast<const volatile unsigned int*>(&header->tp_status);
+	}
+
+public:
+	packet_tx_ring(boost::asio::io_context& ring_io_context, const std::string& interface_name,
+		unsigned int frame_size = 2048, unsigned int frame_count = 4096, bool qdisc_bypass = false)
+		: descriptor_(ring_io_context), ring_(0), current_frame_(0), pending_(0)
+	{
+		// No protocol, the socket is only used to send.
+		int fd = ::socket(AF_PACKET, SOCK_RAW, 0);
+		if (fd < 0)
+			throw_errno("AF_PACKET socket");
+		descriptor_.assign(fd);
+
+		int version = TPACKET_V2;
+		if (::setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+			throw_errno("PACKET_VERSION");
+
+		int bypass = qdisc_bypass ? 1 : 0;
+		if (bypass && ::setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass)) < 0)
+			throw_errno("PACKET_QDISC_BYPASS");
+
+		std::fill(reinterpret_cast<char*>(&req_), reinterpret_cast<char*>(&req_) + sizeof(req_), 0);
+		req_.tp_frame_size = frame_size;
+		req_.tp_frame_nr = frame_count;
+		req_.tp_block_size = frame_size * 64;
+		req_.tp_block_nr = frame_count / 64;
+		if (::setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req_, sizeof(req_)) < 0)
+			throw_errno("PACKET_TX_RING");
+
+		void* ring = ::mmap(0, static_cast<std::size_t>(req_.tp_block_size) * req_.tp_block_nr, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+		if (ring == MAP_FAILED)
+			throw_errno("mmap");
+		ring_ = static_cast<unsigned char*>(ring);
+
+		std::fill(reinterpret_cast<char*>(&address_), reinterpret_cast<char*>(&address_) + sizeof(address_), 0);
+		address_.sll_family = AF_PACKET;
+		address_.sll_protocol = htons(ETH_P_IP);
+		address_.sll_ifindex = ::if_nametoindex(interface_name.c_str());
+		if (address_.sll_ifindex == 0)
+			throw_errno("if_nametoindex");
+	}
+
+	~packet_tx_ring()
+	{
+		if (ring_)
+			::munmap(ring_, static_cast<std::size_t>(req_.tp_block_size) * req_.tp_block_nr);
+	}
+
+	packet_tx_ring(const packet_tx_ring&) = delete;
+	packet_tx_ring& operator=(const packet_tx_ring&) = delete;
+
+	std::size_t pending() const { return pending_; }
+
+	// Writes the probe into the next slot. Returns false when the kernel still owns every slot,
+	// in which case flush() and try again.
+	bool send(const echo_frame& frame, boost::asio::ip::address_v4 destination, unsigned short sequence_number)
+	{
+		const std::size_t data_offset = TPACKET_ALIGN(sizeof(tpacket2_hdr));
+		if (frame.size() > req_.tp_frame_size - data_offset)
+			throw std::length_error("echo frame larger than ring slot");
+
+		tpacket2_hdr* header = slot(current_frame_);
+		if (status(header) != TP_STATUS_AVAILABLE)
+			return false;
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		frame.write(reinterpret_cast<unsigned char*>(header) + data_offset, destination, sequence_number);
+		header->tp_len = static_cast<unsigned int>(frame.size());
+
+		std::atomic_thread_fence(std::memory_order_release);
+		header->tp_status = TP_STATUS_SEND_REQUEST;
+
+		current_frame_ = (current_frame_ + 1) % req_.tp_frame_nr;
+		++pending_;
+		return true;
+	}
+
+	// Kicks the kernel once for every frame queued since the last flush.
+	std::size_t flush()
+	{
+		if (pending_ == 0)
+			return 0;
+
+		if (::sendto(descriptor_.native_handle(), 0, 0, 0, reinterpret_cast<sockaddr*>(&address_), sizeof(address_)) < 0)
+			throw_errno("PACKET_TX_RING send");
+
+		std::size_t sent = pending_;
+		pending_ = 0;
+		return sent;
+	}
+};
+
+// Sends one echo request to every address in [first, last) through a transmit ring (a
+// packet_tx_ring or anything with the same send/pending/flush members), kicking the kernel
+// once per batch of batch_size probes. Addresses filter refuses are skipped. Returns the
+// number of probes sent.
+template <typename Ring, typename Iterator>
+std::size_t send_sweep(Ring& ring, const echo_frame& frame, Iterator first, Iterator last,
+	unsigned short sequence_number, std::size_t batch_size = 256, const target_filter* filter = 0)
+{
+	std::size_t sent = 0;
+
+	for (Iterator it = first; it != last; ++it)
+	{
+		if (filter && !filter->permits(boost::asio::ip::address_v4(*it)))
+			continue;
+		while (!ring.send(frame, *it, sequence_number))
+			sent += ring.flush();
+		if (ring.pending() >= batch_size)
+			sent += ring.flush();
+	}
+
+	return sent + ring.flush();
+}
+
+// Outstanding probes keyed by (destination, identifier, sequence number).
+//
+// The table is split into shards with a lock each, so that the sender and several receive
+// threads only contend when they touch probes that hash to the same shard. Each shard is a
+// probe_table preallocated for capacity / shard_count probes, so neither sending nor matching
+// allocates.
+
+class sharded_probe_table
+{
+private:
+	struct shard
+	{
+		std::mutex mutex;
+		probe_table probes;
+
+		explicit shard(std::size_t capacity) : probes(capacity) {}
+	};
+
+	std::vector<std::unique_ptr<shard> > shards_;
+
+	// Bits 7 to 38 of the hash: clear of the tag in the low 7 and of the home slot in the top ones.
+	shard& shard_for(uint64_t probe)
+	{
+		return *shards_[static_cast<uint32_t>(probe_table::hash(probe) >> 7) % shards_.size()];
+	}
+
+public:
+	explicit sharded_probe_table(std::size_t shard_count = 64, std::size_t capacity = 1 << 20)
+	{
+		for (std::size_t i = 0; i < shard_count; ++i)
+			shards_.push_back(std::unique_ptr<shard>(new shard((capacity + shard_count - 1) / shard_count)));
+	}
+
+	// False if the probe's shard is full.
+	bool insert(boost::asio::ip::address_v4 destination, unsigned short identifier, unsigned short sequence_number,
+		chrono::steady_clock::time_point time_sent)
+	{
+		uint64_t probe = probe_table::key(destination, identifier, sequence_number);
+		shard& s = shard_for(probe);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		return s.probes.insert(probe, time_sent);
+	}
+
+	// Removes the probe a reply answers and gives its round trip time.
+	bool match(boost::asio::ip::address_v4 source, unsigned short identifier, unsigned short sequence_number,
+		chrono::steady_clock::time_point time_received, chrono::steady_clock::duration& rtt)
+	{
+		uint64_t probe = probe_table::key(source, identifier, sequence_number);
+		shard& s = shard_for(probe);
+		chrono::steady_clock::time_point time_sent;
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			if (!s.probes.take(probe, time_sent))
+				return false;
+		}
+		rtt = time_received - time_sent;
+		return true;
+	}
+
+	// Drops the probes sent before deadline and returns how many were lost.
+	std::size_t expire(chrono::steady_clock::time_point deadline)
+	{
+		std::size_t expired = 0;
+		for (std::size_t i = 0; i < shards_.size(); ++i)
+		{
+			std::lock_guard<std::mutex> lock(shards_[i]->mutex);
+			expired += shards_[i]->probes.expire(deadline);
+		}
+		return expired;
+	}
+};
+
+// Receive threads sharing the replies through a PACKET_FANOUT group.
+//
+// Each thread owns a packet_rx_ring in the group and its own io_context, parses its share of
+// the replies and matches them against the sharded probe table. handler(source, sequence, rtt)
+// is called for every matched reply, concurrently from the receive threads. With cpu_pinning
+// the threads are pinned to CPUs 0..thread_count-1, which pairs up well with PACKET_FANOUT_CPU.
+
+class packet_fanout_receiver
+{
+private:
+	sharded_probe_table& table_;
+	std::vector<std::unique_ptr<boost::asio::io_context> > contexts_;
+	std::vector<std::unique_ptr<packet_rx_ring> > rings_;
+	std::vector<std::thread> threads_;
+	bool cpu_pinning_;
+
+public:
+	packet_fanout_receiver(sharded_probe_table& table, unsigned short identifier, std::size_t thread_count,
+		unsigned short group_id, unsigned short mode = PACKET_FANOUT_HASH,
+		const std::string& interface_name = std::string(), bool cpu_pinning = false)
+		: table_(table), cpu_pinning_(cpu_pinning)
+	{
+		for (std::size_t i = 0; i < thread_count; ++i)
+		{
+			contexts_.push_back(std::unique_ptr<boost::asio::io_context>(new boost::asio::io_context(1)));
+			rings_.push_back(std::unique_ptr<packet_rx_ring>(new packet_rx_ring(*contexts_[i], identifier, interface_name)));
+			rings_[i]->join_fanout(group_id, mode);
+		}
+	}
+
+	~packet_fanout_receiver()
+	{
+		stop();
+	}
+
+	packet_fanout_receiver(const packet_fanout_receiver&) = delete;
+	packet_fanout_receiver& operator=(const packet_fanout_receiver&) = delete;
+
+	template <typename Handler>
+	void start(Handler handler)
+	{
+		for (std::size_t i = 0; i < rings_.size(); ++i)
+		{
+			rings_[i]->async_receive([this, handler](const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr) mutable
+				{
+					chrono::steady_clock::duration rtt;
+					if (icmp_hdr.type() == icmp_header::echo_reply
+						&& table_.match(ipv4_hdr.source_address(), icmp_hdr.identifier(), icmp_hdr.sequence_number(), chrono::steady_clock::now(), rtt))
+						handler(ipv4_hdr.source_address(), icmp_hdr.sequence_number(), rtt);
+				});
+
+			boost::asio::io_context* receive_io_context = contexts_[i].get();
+			threads_.push_back(std::thread([receive_io_context]() { receive_io_context->run(); }));
+
+			if (cpu_pinning_)
+			{
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				CPU_SET(static_cast<int>(i % CPU_SETSIZE), &cpus);
+				::pthread_setaffinity_np(threads_.back().native_handle(), sizeof(cpus), &cpus);
+			}
+		}
+	}
+
+	void stop()
+	{
+		for (std::size_t i = 0; i < contexts_.size(); ++i)
+			contexts_[i]->stop();
+		for (std::size_t i = 0; i < threads_.size(); ++i)
+			threads_[i].join();
+		threads_.clear();
+	}
+};
+
+// Same as ping(), with the replies taken from a packet_rx_ring instead of the ICMP socket.
+bool ping_mmap(uint32_t address, uint8_t count, uint16_t timer_milliseconds)
+{
+	boost::asio::io_context ping_io_context;
+
+	pinger p(ping_io_context);
+	p.destination_.address(boost::asio::ip::address_v4(address));
+	p.count_ = (count < 2 ? 2 : count);
+	p.timer_interval_ = timer_milliseconds;
+
+	try
+	{
+		packet_rx_ring ring(ping_io_context, pinger::get_identifier());
+
+		p.start_send();
+		ring.async_receive([&p](const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr)
+			{
+				p.handle_reply(ipv4_hdr, icmp_hdr);
+			});
+
+		while (!p.finished() && ping_io_context.run_one())
+			;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+
+	return (((uint8_t)p.num_replies_ > p.count_ / 2) ? true : false);
+}
+
+#endif // defined(__linux__)
+
+#endif // PACKET_RING_HPP
@@ -9,7 +9,13 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ip/address_v4.hpp>		//used by IP4 header
 #include <boost/bind.hpp>
+#include <array>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
+#include "prefix_set.hpp"
 
 // Packet header for IPv4.
 //
@@ -52,6 +58,12 @@ private:
 
 	unsigned short decode(int a, int b) const { return (rep_[a] << 8) + rep_[b]; }
 
+	void encode(int a, int b, unsigned short n)
+	{
+		rep_[a] = static_cast<unsigned char>(n >> 8);
+		rep_[b] = static_cast<unsigned char>(n & 0xFF);
+	}
+
 public:
 	ipv4_header() { std::fill(rep_, rep_ + sizeof(rep_), 0); }
 	unsigned char version() const { return (rep_[0] >> 4) & 0xF; }
@@ -78,6 +90,54 @@ public:
 		return boost::asio::ip::address_v4(bytes);
 	}
 
+	// Setters for building headers to send with IP_HDRINCL. header_length() also sets the version.
+	void header_length(unsigned short n) { rep_[0] = static_cast<unsigned char>(0x40 | ((n / 4) & 0xF)); }
+	void type_of_service(unsigned char n) { rep_[1] = n; }
+	void total_length(unsigned short n) { encode(2, 3, n); }
+	void identification(unsigned short n) { encode(4, 5, n); }
+	void dont_fragment(bool b) { rep_[6] = static_cast<unsigned char>(b ? (rep_[6] | 0x40) : (rep_[6] & ~0x40)); }
+	void more_fragments(bool b) { rep_[6] = static_cast<unsigned char>(b ? (rep_[6] | 0x20) : (rep_[6] & ~0x20)); }
+	void fragment_offset(unsigned short n) { encode(6, 7, static_cast<unsigned short>((decode(6, 7) & 0xE000) | (n & 0x1FFF))); }
+	void time_to_live(unsigned char n) { rep_[8] = n; }
+	void protocol(unsigned char n) { rep_[9] = n; }
+	void header_checksum(unsigned short n) { encode(10, 11, n); }
+
+	void source_address(const boost::asio::ip::address_v4& address)
+	{
+		boost::asio::ip::address_v4::bytes_type bytes = address.to_bytes();
+		std::copy(bytes.begin(), bytes.end(), rep_ + 12);
+	}
+
+	void destination_address(const boost::asio::ip::address_v4& address)
+	{
+		boost::asio::ip::address_v4::bytes_type bytes = address.to_bytes();
+		std::copy(bytes.begin(), bytes.end(), rep_ + 16);
+	}
+
+	// Options are padded with zeros (end of option list) to a multiple of 4 bytes, 40 at most.
+	void options(const unsigned char* data, std::size_t length)
+	{
+		length = std::min<std::size_t>(length, 40);
+		std::size_t padded_length = (length + 3) & ~static_cast<std::size_t>(3);
+		std::fill(rep_ + 20, rep_ + 60, 0);
+		std::copy(data, data + length, rep_ + 20);
+		header_length(static_cast<unsigned short>(20 + padded_length));
+	}
+
+	// Decodes the header straight from a received packet, e.g. a frame in a shared memory ring.
+	bool parse(const unsigned char* data, std::size_t length)
+	{
+		if (length < 20 || (data[0] >> 4) != 4)
+			return false;
+		std::size_t header_length = (data[0] & 0xF) * 4;
+		if (header_length < 20 || header_length > length)
+			return false;
+		std::copy(data, data + header_length, rep_);
+		return true;
+	}
+
+	void write(unsigned char* data) const { std::copy(rep_, rep_ + header_length(), data); }
+
 	friend std::istream& operator>>(std::istream& is, ipv4_header& header)
 	{
 		is.read(reinterpret_cast<char*>(header.rep_), 20);
@@ -90,6 +150,11 @@ public:
 			is.read(reinterpret_cast<char*>(header.rep_) + 20, options_length);
 		return is;
 	}
+
+	friend std::ostream& operator<<(std::ostream& os, const ipv4_header& header)
+	{
+		return os.write(reinterpret_cast<const char*>(header.rep_), header.header_length());
+	}
 };
 
 // ICMP header for both IPv4 and IPv6.
@@ -142,6 +207,16 @@ public:
 	void identifier(unsigned short n) { encode(4, 5, n); }
 	void sequence_number(unsigned short n) { encode(6, 7, n); }
 
+	bool parse(const unsigned char* data, std::size_t length)
+	{
+		if (length < 8)
+			return false;
+		std::copy(data, data + 8, rep_);
+		return true;
+	}
+
+	void write(unsigned char* data) const { std::copy(rep_, rep_ + 8, data); }
+
 	friend std::istream& operator>>(std::istream& is, icmp_header& header)
 	{
 		return is.read(reinterpret_cast<char*>(header.rep_), 8);
@@ -171,6 +246,199 @@ void compute_checksum(icmp_header& header, Iterator body_begin, Iterator body_en
 	header.checksum(static_cast<unsigned short>(~sum));
 }
 
+// Internet checksum of a contiguous buffer, for whole packets built or received in place.
+//
+// The ones' complement sum does not depend on byte order (RFC 1071), so the buffer is added up
+// as native 32-bit words into a 64-bit accumulator and only the folded result is swapped. The
+// result is in host order, like the values taken by the header setters. Summing a packet with
+// its checksum field filled in gives 0 when the checksum is correct.
+
+inline unsigned short internet_checksum(const unsigned char* data, std::size_t length)
+{
+	uint64_t sum = 0;
+	uint32_t words[2];
+	while (length >= 8)
+	{
+		std::memcpy(words, data, 8);
+		sum += words[0];
+		sum += words[1];
+		data += 8;
+		length -= 8;
+	}
+	if (length >= 4)
+	{
+		std::memcpy(words, data, 4);
+		sum += words[0];
+		data += 4;
+		length -= 4;
+	}
+	if (length > 0)
+	{
+		// Pad the odd byte with zero on the right, as if it were the high byte of a big-endian word.
+		unsigned char tail[4] = { 0, 0, 0, 0 };
+		std::memcpy(tail, data, length);
+		std::memcpy(words, tail, 4);
+		sum += words[0];
+	}
+
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+
+	unsigned short folded = static_cast<unsigned short>(~sum);
+	const unsigned short one = 1;
+	if (*reinterpret_cast<const unsigned char*>(&one) == 1)
+		folded = static_cast<unsigned short>((folded >> 8) | (folded << 8));
+	return folded;
+}
+
+// Checksums of received IPv4 packets carrying ICMP, verified before the headers are parsed.
+//
+// Both sums run over the packet where it was received, with internet_checksum: about one
+// addition per 8 bytes, so a few nanoseconds for an echo reply, cheap enough to leave enabled_.
+// A packet shorter than its total length (a truncated read) only has its IPv4 header checked,
+// and one too short for a header is left for the parser to reject.
+//
+// verify() is for frames taken from AF_PACKET and AF_XDP rings, which have not been through
+// the IP layer. Raw sockets only deliver packets whose IPv4 header checksum the kernel has
+// already verified, and on BSD and macOS they give the total length in host byte order, so
+// verify_icmp() checks the ICMP message alone and takes its length from the read.
+
+class checksum_verifier
+{
+public:
+	bool enabled_;
+	std::size_t bad_ipv4_;
+	std::size_t bad_icmp_;
+
+	checksum_verifier() : enabled_(true), bad_ipv4_(0), bad_icmp_(0) {}
+
+	std::size_t corrupted() const { return bad_ipv4_ + bad_icmp_; }
+
+	// False, and counted, if either checksum is wrong.
+	bool verify(const unsigned char* packet, std::size_t length)
+	{
+		if (!enabled_ || length < 20)
+			return true;
+
+		std::size_t header_length = (packet[0] & 0xF) * 4;
+		if (header_length < 20 || header_length > length)
+			return true;
+		if (internet_checksum(packet, header_length) != 0)
+		{
+			++bad_ipv4_;
+			return false;
+		}
+
+		std::size_t total_length = (static_cast<std::size_t>(packet[2]) << 8) | packet[3];
+		if (total_length > length || total_length < header_length)
+			return true;
+		if (internet_checksum(packet + header_length, total_length - header_length) != 0)
+		{
+			++bad_icmp_;
+			return false;
+		}
+		return true;
+	}
+
+	// For a read of length bytes into a buffer of capacity bytes; a read that filled the buffer
+	// may have been truncated and is not checked.
+	bool verify_icmp(const unsigned char* packet, std::size_t length, std::size_t capacity)
+	{
+		if (!enabled_ || length < 20 || length >= capacity)
+			return true;
+
+		std::size_t header_length = (packet[0] & 0xF) * 4;
+		if (header_length < 20 || header_length > length)
+			return true;
+		if (internet_checksum(packet + header_length, length - header_length) != 0)
+		{
+			++bad_icmp_;
+			return false;
+		}
+		return true;
+	}
+};
+
+inline void compute_checksum(ipv4_header& header)
+{
+	unsigned char rep[60];
+	header.header_checksum(0);
+	header.write(rep);
+	header.header_checksum(internet_checksum(rep, header.header_length()));
+}
+
+// IPv4 header template for probes sent with IP_HDRINCL: version 4, no options, TTL 64,
+// protocol ICMP. Set TOS, TTL, DF, identification or options on it as needed.
+inline ipv4_header icmp_ipv4_template(unsigned char type_of_service = 0, unsigned char time_to_live = 64, bool dont_fragment = false)
+{
+	ipv4_header header;
+	header.header_length(20);
+	header.type_of_service(type_of_service);
+	header.time_to_live(time_to_live);
+	header.dont_fragment(dont_fragment);
+	header.protocol(IPPROTO_ICMP);
+	return header;
+}
+
+// Body of the echo requests.
+//
+// The buffer is allocated once for the configured length and refilled in place for every
+// probe: with the pattern repeated (fixed_pattern, the default, which gives the classic
+// 36-byte body), with the pattern shifted by the sequence number (rotating_pattern), or with
+// fresh pseudo-random bytes from a xorshift generator (random_bytes), which defeats link
+// compression and payload-based caching.
+
+class echo_payload
+{
+public:
+	enum kind { fixed_pattern, rotating_pattern, random_bytes };
+
+private:
+	kind kind_;
+	std::string pattern_;
+	std::vector<unsigned char> body_;
+	uint64_t state_;
+
+	void fill(std::size_t shift)
+	{
+		for (std::size_t i = 0; i < body_.size(); ++i)
+			body_[i] = static_cast<unsigned char>(pattern_[(i + shift) % pattern_.size()]);
+	}
+
+public:
+	echo_payload(std::size_t length = 36, kind payload_kind = fixed_pattern,
+		const std::string& pattern = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ")
+		: kind_(payload_kind), pattern_(pattern.empty() ? std::string(1, '\0') : pattern), body_(length), state_(0x9E3779B97F4A7C15ULL)
+	{
+		fill(0);
+	}
+
+	std::size_t size() const { return body_.size(); }
+
+	// Refills the body for the probe with this sequence number and returns it.
+	const std::vector<unsigned char>& next(unsigned short sequence_number)
+	{
+		if (kind_ == rotating_pattern)
+			fill(sequence_number);
+		else if (kind_ == random_bytes)
+		{
+			for (std::size_t i = 0; i < body_.size(); i += 8)
+			{
+				state_ ^= state_ >> 12;
+				state_ ^= state_ << 25;
+				state_ ^= state_ >> 27;
+				uint64_t bits = state_ * 0x2545F4914F6CDD1DULL;
+				std::size_t n = std::min<std::size_t>(8, body_.size() - i);
+				std::memcpy(&body_[i], &bits, n);
+			}
+		}
+		return body_;
+	}
+};
+
 //
 // pinger class
 //
@@ -179,6 +447,56 @@ using boost::asio::ip::icmp;
 using boost::asio::steady_timer;
 namespace chrono = boost::asio::chrono;
 
+// Set on a raw socket, we supply the IPv4 header of every packet we send.
+typedef boost::asio::detail::socket_option::boolean<IPPROTO_IP, IP_HDRINCL> ip_header_included;
+
+// Running RTT and loss statistics for a series of probes, updated in O(1) per probe
+// (Welford's method for the variance).
+
+class probe_statistics
+{
+private:
+	std::size_t sent_;
+	std::size_t received_;
+	double min_;
+	double max_;
+	double mean_;
+	double m2_;
+
+public:
+	probe_statistics() : sent_(0), received_(0), min_(0), max_(0), mean_(0), m2_(0) {}
+
+	std::size_t sent() const { return sent_; }
+	std::size_t received() const { return received_; }
+	double loss() const { return sent_ ? 1.0 - static_cast<double>(received_) / sent_ : 0.0; }
+
+	// Round trip times in milliseconds.
+	double min_rtt() const { return min_; }
+	double max_rtt() const { return max_; }
+	double mean_rtt() const { return mean_; }
+	double stddev_rtt() const { return received_ > 1 ? std::sqrt(m2_ / (received_ - 1)) : 0.0; }
+
+	void add_sent() { ++sent_; }
+
+	// Takes a lost probe back out of sent(), for a loss that says nothing about the path.
+	void discount()
+	{
+		if (sent_ > received_)
+			--sent_;
+	}
+
+	void add_reply(chrono::steady_clock::duration rtt)
+	{
+		double ms = chrono::duration_cast<chrono::microseconds>(rtt).count() / 1000.0;
+		min_ = (received_ == 0 || ms < min_) ? ms : min_;
+		max_ = (received_ == 0 || ms > max_) ? ms : max_;
+		++received_;
+		double delta = ms - mean_;
+		mean_ += delta / received_;
+		m2_ += delta * (ms - mean_);
+	}
+};
+
 class pinger
 {
 private:
@@ -186,7 +504,10 @@ private:
 	steady_timer timer_;
 	chrono::steady_clock::time_point time_sent_;
 	boost::asio::streambuf reply_buffer_;
+	std::vector<ipv4_header> ip_templates_;
+	unsigned char request_header_[60 + 8];
 
+public:
 	static unsigned short get_identifier()
 	{
 #if defined(BOOST_ASIO_WINDOWS)
@@ -196,42 +517,77 @@ private:
 #endif
 	}
 
-public:
 	icmp::endpoint destination_;
 	std::size_t num_replies_;
+	std::size_t misdirected_;
 	uint8_t sequence_number_;
 	uint8_t count_;
 	uint16_t timer_interval_;
+	echo_payload payload_;
+	const target_filter* filter_;
+	checksum_verifier checksums_;
 
-	pinger(boost::asio::io_context& ping_io_context) : socket_(ping_io_context, icmp::v4()), timer_(ping_io_context)
+	pinger(boost::asio::io_context& ping_io_context) : socket_(ping_io_context, icmp::v4()), timer_(ping_io_context), filter_(0)
 	{
 		num_replies_ = 0;
+		misdirected_ = 0;
 		sequence_number_ = 0;
 	};
 
+	// Once a template is added, every probe is sent with IP_HDRINCL and its IPv4 header is
+	// taken from the templates in turn, so TOS/DSCP, TTL, DF, identification and options can
+	// change from one probe to the next on the same socket. The total length, destination and
+	// header checksum are filled in per probe; a zero identification or source address is
+	// left for the kernel to fill in.
+	void add_template(const ipv4_header& ip_template)
+	{
+		if (ip_templates_.empty())
+			socket_.set_option(ip_header_included(true));
+		ip_templates_.push_back(ip_template);
+	}
+
 	void start_send()
 	{
 		if (sequence_number_ >= count_)
 			return;
 
-		std::string body("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+		// A destination the filter refuses gets no probe at all.
+		if (filter_ && !filter_->permits(destination_.address()))
+		{
+			count_ = sequence_number_;
+			socket_.close();
+			return;
+		}
+
+		const std::vector<unsigned char>& body = payload_.next(++sequence_number_);
 
 		// Create an ICMP header for an echo request.
 		icmp_header echo_request;
 		echo_request.type(icmp_header::echo_request);
 		echo_request.code(0);
 		echo_request.identifier(get_identifier());
-		echo_request.sequence_number(++sequence_number_);
+		echo_request.sequence_number(sequence_number_);
 		compute_checksum(echo_request, body.begin(), body.end());
 
-		// Encode the request packet.
-		boost::asio::streambuf request_buffer;
-		std::ostream os(&request_buffer);
-		os << echo_request << body;
+		// Encode the request headers; the body is sent straight from the payload buffer.
+		std::size_t header_length = 0;
+		if (!ip_templates_.empty())
+		{
+			ipv4_header ipv4_hdr = ip_templates_[(sequence_number_ - 1) % ip_templates_.size()];
+			ipv4_hdr.total_length(static_cast<unsigned short>(ipv4_hdr.header_length() + 8 + body.size()));
+			ipv4_hdr.destination_address(destination_.address().to_v4());
+			compute_checksum(ipv4_hdr);
+			ipv4_hdr.write(request_header_);
+			header_length = ipv4_hdr.header_length();
+		}
+		echo_request.write(request_header_ + header_length);
+		header_length += 8;
+
+		std::array<boost::asio::const_buffer, 2> request = { { boost::asio::buffer(request_header_, header_length), boost::asio::buffer(body) } };
 
 		// Send the request.
 		time_sent_ = steady_timer::clock_type::now();
-		socket_.send_to(request_buffer.data(), destination_);
+		socket_.send_to(request, destination_);
 
 		timer_.expires_at(time_sent_ + chrono::milliseconds(timer_interval_));
 		timer_.async_wait([this](const boost::system::error_code& error)
@@ -248,6 +604,36 @@ public:
 			});
 	}
 
+	// We can receive all ICMP packets received by the host, so we need to
+	// filter out only the echo replies that match the our identifier and expected sequence number.
+	// A match from any address but the destination is counted in misdirected_ instead: another
+	// process's probe with the same identifier, or a spoofed reply.
+	void handle_reply(const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr)
+	{
+		if (icmp_hdr.type() == icmp_header::echo_reply
+			&& icmp_hdr.identifier() == get_identifier()
+			&& icmp_hdr.sequence_number() == sequence_number_)
+		{
+			if (ipv4_hdr.source_address() != destination_.address().to_v4())
+			{
+				++misdirected_;
+				return;
+			}
+			++num_replies_;
+			// Print out some information about the reply packet.
+//			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+//			chrono::steady_clock::duration elapsed = now - time_sent_;
+
+//			std::cout << "\n reply received in " << chrono::duration_cast<chrono::milliseconds>(elapsed).count() << " msec\n\n";
+		}
+	}
+
+	// The socket is closed by the last timeout, after which no more replies are counted.
+	bool finished() const { return !socket_.is_open(); }
+
+	// For socket options asio has no type for.
+	icmp::socket::native_handle_type native_handle() { return socket_.native_handle(); }
+
 	void start_receive()
 	{
 		// Discard any data already in the buffer.
@@ -261,24 +647,16 @@ public:
 				// The actual number of bytes received is committed to the buffer so that we can extract it using a std::istream object.
 				reply_buffer_.commit(bytes_transferred);
 
-				// Decode the reply packet.
-				std::istream is(&reply_buffer_);
-				ipv4_header ipv4_hdr;
-				icmp_header icmp_hdr;
-				is >> ipv4_hdr >> icmp_hdr;
-
-				// We can receive all ICMP packets received by the host, so we need to
-				// filter out only the echo replies that match the our identifier and expected sequence number.
-				if (is && icmp_hdr.type() == icmp_header::echo_reply
-					&& icmp_hdr.identifier() == get_identifier()
-					&& icmp_hdr.sequence_number() == sequence_number_)
+				// Decode the reply packet, unless it arrived corrupted.
+				if (checksums_.verify_icmp(static_cast<const unsigned char*>(reply_buffer_.data().data()), bytes_transferred, 1024))
 				{
-					++num_replies_;
-					// Print out some information about the reply packet.
-	//				chrono::steady_clock::time_point now = chrono::steady_clock::now();
-	//				chrono::steady_clock::duration elapsed = now - time_sent_;
+					std::istream is(&reply_buffer_);
+					ipv4_header ipv4_hdr;
+					icmp_header icmp_hdr;
+					is >> ipv4_hdr >> icmp_hdr;
 
-	//				std::cout << "\n reply received in " << chrono::duration_cast<chrono::milliseconds>(elapsed).count() << " msec\n\n";
+					if (is)
+						handle_reply(ipv4_hdr, icmp_hdr);
 				}
 
 				if (sequence_number_ < count_)
@@ -0,0 +1,363 @@
+//
+// pmtu.hpp : path MTU discovery with parallel DF probes of several sizes
+// void discover_pmtu(hex_ip4_addresses, cache, max_mtu, timeout_millisecond)
+//
+
+#ifndef PMTU_HPP
+#define PMTU_HPP
+
+#include "ping.hpp"
+#include <map>
+
+// Discovered path MTUs, kept for ttl seconds per target.
+
+class pmtu_cache
+{
+private:
+	struct entry
+	{
+		unsigned short mtu;
+		chrono::steady_clock::time_point expires;
+	};
+
+	std::map<uint32_t, entry> entries_;
+
+public:
+	chrono::seconds ttl_;
+
+	pmtu_cache() : ttl_(600) {}
+
+	void insert(boost::asio::ip::address_v4 address, unsigned short mtu)
+	{
+		entry e = { mtu, steady_timer::clock_type::now() + ttl_ };
+		entries_[address.to_uint()] = e;
+	}
+
+	bool find(boost::asio::ip::address_v4 address, unsigned short& mtu) const
+	{
+		std::map<uint32_t, entry>::const_iterator it = entries_.find(address.to_uint());
+		if (it == entries_.end() || it->second.expires < steady_timer::clock_type::now())
+			return false;
+		mtu = it->second.mtu;
+		return true;
+	}
+};
+
+// pmtu_prober class
+//
+// For every target the path MTU lies in [low, high]: low is the largest packet size known to
+// get through (68, the IPv4 minimum, to begin with) and high the largest one that still might.
+// Each round sends parallel_ echo requests with DF set, of sizes spread evenly over (low, high],
+// high included, so the common case of a clean path is settled in one round trip and every
+// other round cuts the range parallel_ + 1 ways instead of in half.
+//
+//   - an echo reply raises low to the size of its probe;
+//   - a fragmentation needed error (ICMP type 3 code 4) lowers high to the next-hop MTU it
+//     carries, or below the probe's size if the router left it out;
+//   - a probe still unanswered at the end of the round makes its size a suspect, sent again
+//     in the next round; if it goes unanswered again it lowers high below its size, which is
+//     how MTU black holes (routers that drop without telling) show up. One random loss is not
+//     enough to cache a low path MTU, and a loss smaller than a size that got through is only
+//     a loss.
+//
+// Until a target has answered an echo request, or a router has sent a fragmentation needed
+// error for one, nothing says the path works at all, and each round also probes it at low, the
+// minimum size. A target that stays silent for two rounds is done and unreachable.
+//
+// A round ends as soon as every probe is answered, or after timeout_. Targets whose range
+// has shrunk to resolution_ are done and their path MTU (low) goes into the cache, if the path
+// was confirmed; targets found in the cache, and those filter_ refuses at start(), are not
+// probed at all.
+
+class pmtu_prober
+{
+private:
+	struct probe
+	{
+		std::size_t target;
+		unsigned short size;
+	};
+
+	struct search
+	{
+		icmp::endpoint destination;
+		unsigned short low;
+		unsigned short high;
+		bool done;
+		unsigned short suspect;
+		bool confirmed;
+		bool unreachable;
+		unsigned int rounds;
+		bool excluded;
+	};
+
+	icmp::socket socket_;
+	steady_timer timer_;
+	boost::asio::streambuf reply_buffer_;
+	pmtu_cache& cache_;
+	std::vector<search> searches_;
+	std::map<unsigned short, probe> outstanding_;
+	std::vector<unsigned char> packet_;
+	unsigned short sequence_number_;
+
+	void send(std::size_t target, unsigned short size)
+	{
+		// The body is whatever the buffer holds beyond the headers; only the headers are rewritten.
+		icmp_header echo_request;
+		echo_request.type(icmp_header::echo_request);
+		echo_request.code(0);
+		echo_request.identifier(pinger::get_identifier());
+		echo_request.sequence_number(++sequence_number_);
+		echo_request.write(&packet_[20]);
+		echo_request.checksum(internet_checksum(&packet_[20], size - 20));
+		echo_request.write(&packet_[20]);
+
+		ipv4_header ipv4_hdr = icmp_ipv4_template(0, 64, true);
+		ipv4_hdr.total_length(size);
+		ipv4_hdr.destination_address(searches_[target].destination.address().to_v4());
+		compute_checksum(ipv4_hdr);
+		ipv4_hdr.write(&packet_[0]);
+
+		probe p = { target, size };
+		outstanding_[sequence_number_] = p;
+
+		// Too big for our own interface: the kernel says so right away.
+		boost::system::error_code error;
+		socket_.send_to(boost::asio::buffer(&packet_[0], size), searches_[target].destination, 0, error);
+		if (error == boost::asio::error::message_size)
+		{
+			outstanding_.erase(sequence_number_);
+			lower(target, static_cast<unsigned short>(size - 1));
+		}
+	}
+
+	void lower(std::size_t target, unsigned short high)
+	{
+		search& s = searches_[target];
+		s.high = std::max(s.low, std::min(s.high, high));
+	}
+
+	void start_round()
+	{
+		// Whatever is still unanswered from the last round is suspected of being too big, and
+		// taken as too big if it was already suspected; otherwise the smallest such size becomes
+		// the suspect, probed again next round.
+		std::vector<unsigned short> unanswered(searches_.size(), 0);
+		for (std::map<unsigned short, probe>::iterator it = outstanding_.begin(); it != outstanding_.end(); ++it)
+		{
+			search& s = searches_[it->second.target];
+			unsigned short size = it->second.size;
+			if (size <= s.low)
+				continue;
+			if (size == s.suspect)
+				lower(it->second.target, static_cast<unsigned short>(size - 1));
+			else if (!unanswered[it->second.target] || size < unanswered[it->second.target])
+				unanswered[it->second.target] = size;
+		}
+		outstanding_.clear();
+		for (std::size_t target = 0; target < searches_.size(); ++target)
+		{
+			search& s = searches_[target];
+			s.suspect = unanswered[target] > s.low && unanswered[target] <= s.high ? unanswered[target] : 0;
+		}
+
+		bool probing = false;
+		for (std::size_t target = 0; target < searches_.size(); ++target)
+		{
+			search& s = searches_[target];
+			if (s.done)
+				continue;
+
+			if (!s.confirmed && s.rounds >= 2)
+			{
+				s.done = s.unreachable = true;
+				continue;
+			}
+
+			if (s.high - s.low <= resolution_)
+			{
+				s.done = true;
+				if (s.confirmed)
+					cache_.insert(s.destination.address().to_v4(), s.low);
+				else
+					s.unreachable = true;
+				continue;
+			}
+
+			probing = true;
+			++s.rounds;
+			if (!s.confirmed)
+				send(target, s.low);
+			if (s.suspect)
+				send(target, s.suspect);
+			unsigned short previous = s.low;
+			for (unsigned int i = 1; i <= parallel_; ++i)
+			{
+				unsigned short size = static_cast<unsigned short>(s.low + ((s.high - s.low) * i + parallel_ - 1) / parallel_);
+				if (size > previous && size != s.suspect)
+					send(target, size);
+				previous = size;
+			}
+		}
+
+		if (!probing)
+		{
+			socket_.close();
+			return;
+		}
+
+		timer_.expires_after(chrono::milliseconds(timeout_));
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_timeout lambda, also called when the round is cut short
+				if (socket_.is_open())
+					start_round();
+			});
+	}
+
+	void handle_reply(const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr, std::istream& is)
+	{
+		unsigned short sequence_number = icmp_hdr.sequence_number();
+
+		if (icmp_hdr.type() == icmp_header::destination_unreachable && icmp_hdr.code() == 4)
+		{
+			// The error quotes our IPv4 header and the first 8 bytes after it, i.e. the echo request.
+			ipv4_header quoted_ipv4_hdr;
+			icmp_header quoted_icmp_hdr;
+			is >> quoted_ipv4_hdr >> quoted_icmp_hdr;
+			if (!is || quoted_icmp_hdr.type() != icmp_header::echo_request || quoted_icmp_hdr.identifier() != pinger::get_identifier())
+				return;
+			sequence_number = quoted_icmp_hdr.sequence_number();
+		}
+		else if (icmp_hdr.type() != icmp_header::echo_reply || icmp_hdr.identifier() != pinger::get_identifier())
+			return;
+
+		std::map<unsigned short, probe>::iterator it = outstanding_.find(sequence_number);
+		if (it == outstanding_.end())
+			return;
+
+		search& s = searches_[it->second.target];
+		if (icmp_hdr.type() == icmp_header::echo_reply)
+		{
+			if (ipv4_hdr.source_address() != s.destination.address().to_v4())
+				return;
+			s.low = std::max(s.low, it->second.size);
+			s.high = std::max(s.high, s.low);
+			s.confirmed = true;
+		}
+		else
+		{
+			// The next-hop MTU is in the low half of the second word, where an echo has its sequence number.
+			unsigned short next_hop_mtu = icmp_hdr.sequence_number();
+			lower(it->second.target, next_hop_mtu >= 68 && next_hop_mtu < it->second.size ? next_hop_mtu : static_cast<unsigned short>(it->second.size - 1));
+			s.confirmed = true;
+		}
+		outstanding_.erase(it);
+
+		if (outstanding_.empty())
+			timer_.cancel();
+	}
+
+public:
+	unsigned int parallel_;
+	uint16_t timeout_;
+	unsigned short resolution_;
+	const target_filter* filter_;
+	checksum_verifier checksums_;
+
+	pmtu_prober(boost::asio::io_context& ping_io_context, pmtu_cache& cache, const std::vector<boost::asio::ip::address_v4>& targets,
+		unsigned short max_mtu = 1500)
+		: socket_(ping_io_context, icmp::v4()), timer_(ping_io_context), cache_(cache), packet_(max_mtu, 0),
+		sequence_number_(0), parallel_(4), timeout_(1000), resolution_(0), filter_(0)
+	{
+		for (std::size_t i = 0; i < targets.size(); ++i)
+		{
+			unsigned short mtu = 0;
+			search s = { icmp::endpoint(targets[i], 0), 68, max_mtu, cache_.find(targets[i], mtu), 0, false, false, 0, false };
+			searches_.push_back(s);
+		}
+
+		std::string body("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+		for (std::size_t i = 28; i < packet_.size(); ++i)
+			packet_[i] = body[i % body.size()];
+
+		socket_.set_option(ip_header_included(true));
+	}
+
+	void start()
+	{
+		for (std::size_t target = 0; target < searches_.size(); ++target)
+		{
+			search& s = searches_[target];
+			s.excluded = filter_ && !filter_->permits(s.destination.address());
+			s.done = s.done || s.excluded;
+		}
+
+		start_round();
+		start_receive();
+	}
+
+	void start_receive()
+	{
+		reply_buffer_.consume(reply_buffer_.size());
+
+		socket_.async_receive(reply_buffer_.prepare(1024), [this](const boost::system::error_code& error, std::size_t bytes_transferred)
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				reply_buffer_.commit(bytes_transferred);
+
+				if (checksums_.verify_icmp(static_cast<const unsigned char*>(reply_buffer_.data().data()), bytes_transferred, 1024))
+				{
+					std::istream is(&reply_buffer_);
+					ipv4_header ipv4_hdr;
+					icmp_header icmp_hdr;
+					is >> ipv4_hdr >> icmp_hdr;
+
+					if (is)
+						handle_reply(ipv4_hdr, icmp_hdr, is);
+				}
+
+				start_receive();
+			});
+	}
+
+	// Path MTU of a target once its search is done, 0 until then.
+	unsigned short pmtu(std::size_t target) const
+	{
+		unsigned short mtu = 0;
+		cache_.find(searches_[target].destination.address().to_v4(), mtu);
+		return mtu;
+	}
+
+	// True once a target's search has ended without a single answer.
+	bool unreachable(std::size_t target) const { return searches_[target].unreachable; }
+
+	bool excluded(std::size_t target) const { return searches_[target].excluded; }
+};
+
+void discover_pmtu(const std::vector<uint32_t>& addresses, pmtu_cache& cache, unsigned short max_mtu, uint16_t timeout_milliseconds)
+{
+	boost::asio::io_context ping_io_context;
+
+	std::vector<boost::asio::ip::address_v4> targets;
+	for (std::size_t i = 0; i < addresses.size(); ++i)
+		targets.push_back(boost::asio::ip::address_v4(addresses[i]));
+
+	try
+	{
+		pmtu_prober p(ping_io_context, cache, targets, max_mtu);
+		p.timeout_ = timeout_milliseconds;
+		p.start();
+
+		ping_io_context.run();
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+}
+
+#endif // PMTU_HPP
@@ -0,0 +1,348 @@
+//
+// prefix_set.hpp : longest-prefix-match sets of IPv4 and IPv6 prefixes, for exclusion lists and allowlists
+//
+
+#ifndef PREFIX_SET_HPP
+#define PREFIX_SET_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/system/system_error.hpp>
+#include <array>
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+// Without the POPCNT instruction, the builtin is a library call; the bit trick is faster.
+inline unsigned int popcount64(uint64_t x)
+{
+#if defined(__GNUC__) && defined(__POPCNT__)
+	return static_cast<unsigned int>(__builtin_popcountll(x));
+#elif defined(_MSC_VER) && defined(_M_X64)
+	return static_cast<unsigned int>(__popcnt64(x));
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return static_cast<unsigned int>((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// prefix_trie class
+//
+// A poptrie over keys of Bytes bytes: the first 16 bits index a flat array, and the rest are
+// taken 6 at a time through nodes of two 64-bit bitmaps. A node's vector has a bit for each of
+// its 64 branches that leads to another node, and its leafvec a bit where a run of branches
+// with the same result starts; the children and the results of a node are stored contiguously,
+// so the position of either is its base plus a popcount of the bitmap below the branch. An
+// IPv4 lookup is one array read and at most three nodes, an IPv6 one at most nineteen.
+//
+// Prefixes are added to a plain binary trie, and compile() rebuilds the poptrie from it; a
+// prefix added as not included punches a hole in the shorter ones around it.
+
+template <std::size_t Bytes>
+class prefix_trie
+{
+public:
+	typedef std::array<unsigned char, Bytes> key_type;
+
+private:
+	enum { bits = Bytes * 8, direct_bits = 16, stride = 6 };
+
+	struct build_node
+	{
+		uint32_t child[2];
+		signed char value;
+	};
+
+	struct node
+	{
+		uint64_t vector;
+		uint64_t leafvec;
+		uint32_t base0;
+		uint32_t base1;
+	};
+
+	// A direct_ entry with this bit set is a node index, otherwise a result.
+	static const uint32_t is_node = 0x80000000;
+
+	std::vector<build_node> build_;
+	std::size_t size_;
+	std::vector<uint32_t> direct_;
+	std::vector<node> nodes_;
+	std::vector<unsigned char> leaves_;
+
+	static unsigned int bit(const key_type& key, std::size_t offset)
+	{
+		return (key[offset / 8] >> (7 - offset % 8)) & 1;
+	}
+
+	// width bits of key from offset, width at most 16.
+	static unsigned int chunk(const key_type& key, std::size_t offset, std::size_t width)
+	{
+		std::size_t byte = offset / 8;
+		uint32_t word = static_cast<uint32_t>(key[byte]) << 16;
+		if (byte + 1 < Bytes)
+			word |= static_cast<uint32_t>(key[byte + 1]) << 8;
+		if (byte + 2 < Bytes)
+			word |= key[byte + 2];
+		return (word >> (24 - offset % 8 - width)) & ((1u << width) - 1);
+	}
+
+	static std::size_t width_at(std::size_t depth) { return depth + stride < bits ? std::size_t(stride) : bits - depth; }
+
+	bool has_children(uint32_t n) const { return build_[n].child[0] || build_[n].child[1]; }
+
+	// Follows width bits of branch down from n; gives the node reached, or 0 if the path ends
+	// first, and the result of the longest prefix on the way.
+	uint32_t descend(uint32_t n, unsigned int branch, std::size_t width, unsigned char& value) const
+	{
+		for (std::size_t k = width; k-- > 0;)
+		{
+			n = build_[n].child[(branch >> k) & 1];
+			if (!n)
+				return 0;
+			if (build_[n].value >= 0)
+				value = static_cast<unsigned char>(build_[n].value);
+		}
+		return n;
+	}
+
+	void fill(std::size_t index, uint32_t n, std::size_t depth, unsigned char value)
+	{
+		std::size_t width = width_at(depth);
+		std::size_t branches = std::size_t(1) << width;
+
+		std::vector<uint32_t> children;
+		std::vector<unsigned char> child_values;
+		node result = { 0, 0, static_cast<uint32_t>(leaves_.size()), 0 };
+		bool first_leaf = true;
+		unsigned char last = 0;
+		for (std::size_t i = 0; i < branches; ++i)
+		{
+			unsigned char v = value;
+			uint32_t reached = descend(n, static_cast<unsigned int>(i), width, v);
+			if (reached && has_children(reached))
+			{
+				result.vector |= uint64_t(1) << i;
+				children.push_back(reached);
+				child_values.push_back(v);
+			}
+			else if (first_leaf || v != last)
+			{
+				result.leafvec |= uint64_t(1) << i;
+				leaves_.push_back(v);
+				first_leaf = false;
+				last = v;
+			}
+		}
+
+		result.base1 = static_cast<uint32_t>(nodes_.size());
+		nodes_.resize(nodes_.size() + children.size());
+		nodes_[index] = result;
+		for (std::size_t k = 0; k < children.size(); ++k)
+			fill(result.base1 + k, children[k], depth + width, child_values[k]);
+	}
+
+public:
+	prefix_trie() : size_(0)
+	{
+		build_node root = { { 0, 0 }, -1 };
+		build_.push_back(root);
+	}
+
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+
+	// Bytes of the compiled lookup structure.
+	std::size_t memory() const
+	{
+		return direct_.size() * sizeof(uint32_t) + nodes_.size() * sizeof(node) + leaves_.size();
+	}
+
+	// Takes effect at the next compile(); bits of key past length are ignored.
+	void add(const key_type& key, std::size_t length, bool included = true)
+	{
+		uint32_t n = 0;
+		for (std::size_t i = 0; i < length && i < bits; ++i)
+		{
+			unsigned int b = bit(key, i);
+			if (!build_[n].child[b])
+			{
+				build_node empty = { { 0, 0 }, -1 };
+				build_.push_back(empty);
+				build_[n].child[b] = static_cast<uint32_t>(build_.size() - 1);
+			}
+			n = build_[n].child[b];
+		}
+		if (build_[n].value < 0)
+			++size_;
+		build_[n].value = included ? 1 : 0;
+	}
+
+	void compile()
+	{
+		if (empty())
+		{
+			direct_.clear();
+			nodes_.clear();
+			leaves_.clear();
+			return;
+		}
+
+		direct_.assign(std::size_t(1) << direct_bits, 0);
+		nodes_.clear();
+		leaves_.clear();
+
+		unsigned char root = build_[0].value > 0 ? 1 : 0;
+		for (std::size_t i = 0; i < direct_.size(); ++i)
+		{
+			unsigned char v = root;
+			uint32_t reached = descend(0, static_cast<unsigned int>(i), direct_bits, v);
+			if (reached && has_children(reached))
+			{
+				std::size_t index = nodes_.size();
+				nodes_.resize(index + 1);
+				fill(index, reached, direct_bits, v);
+				direct_[i] = is_node | static_cast<uint32_t>(index);
+			}
+			else
+				direct_[i] = v;
+		}
+	}
+
+	// The longest prefix of key that was added decides; false if there is none.
+	bool contains(const key_type& key) const
+	{
+		if (direct_.empty())
+			return false;
+
+		uint32_t entry = direct_[chunk(key, 0, direct_bits)];
+		if (!(entry & is_node))
+			return entry != 0;
+
+		const node* n = &nodes_[entry & ~is_node];
+		for (std::size_t depth = direct_bits;;)
+		{
+			std::size_t width = width_at(depth);
+			uint64_t branch = uint64_t(1) << chunk(key, depth, width);
+			if (!(n->vector & branch))
+				return leaves_[n->base0 + popcount64(n->leafvec & ((branch << 1) - 1)) - 1] != 0;
+			n = &nodes_[n->base1 + popcount64(n->vector & (branch - 1))];
+			depth += width;
+		}
+	}
+};
+
+// prefix_set class
+//
+// IPv4 and IPv6 prefixes together, each family in its own prefix_trie. load() reads CIDR
+// lines ("192.0.2.0/24", "2001:db8::/32", or a bare address for a host), one per line, with
+// blank lines and '#' comments skipped, and compiles the set at the end; for prefixes added
+// one by one, compile() must be called before lookups see them.
+
+class prefix_set
+{
+private:
+	prefix_trie<4> v4_;
+	prefix_trie<16> v6_;
+
+	static boost::system::system_error invalid(const std::string& cidr)
+	{
+		return boost::system::system_error(boost::system::errc::make_error_code(boost::system::errc::invalid_argument), "prefix " + cidr);
+	}
+
+public:
+	std::size_t size() const { return v4_.size() + v6_.size(); }
+	bool empty() const { return v4_.empty() && v6_.empty(); }
+	std::size_t memory() const { return v4_.memory() + v6_.memory(); }
+
+	void add(const boost::asio::ip::address& address, std::size_t length, bool included = true)
+	{
+		if (address.is_v4())
+			v4_.add(address.to_v4().to_bytes(), length, included);
+		else
+			v6_.add(address.to_v6().to_bytes(), length, included);
+	}
+
+	void add(const std::string& cidr, bool included = true)
+	{
+		std::string::size_type slash = cidr.find('/');
+		boost::system::error_code error;
+		boost::asio::ip::address address = boost::asio::ip::make_address(cidr.substr(0, slash), error);
+		if (error)
+			throw invalid(cidr);
+
+		std::size_t bits = address.is_v4() ? 32 : 128;
+		std::size_t length = bits;
+		if (slash != std::string::npos)
+		{
+			std::string digits = cidr.substr(slash + 1);
+			if (digits.empty() || digits.size() > 3 || digits.find_first_not_of("0123456789") != std::string::npos)
+				throw invalid(cidr);
+			length = std::stoul(digits);
+			if (length > bits)
+				throw invalid(cidr);
+		}
+		add(address, length, included);
+	}
+
+	// Returns the number of prefixes read.
+	std::size_t load(std::istream& is, bool included = true)
+	{
+		std::size_t loaded = 0;
+		std::string line;
+		while (std::getline(is, line))
+		{
+			std::string::size_type comment = line.find('#');
+			if (comment != std::string::npos)
+				line.erase(comment);
+			std::string::size_type first = line.find_first_not_of(" \t\r");
+			if (first == std::string::npos)
+				continue;
+			std::string::size_type last = line.find_last_not_of(" \t\r");
+			add(line.substr(first, last - first + 1), included);
+			++loaded;
+		}
+		compile();
+		return loaded;
+	}
+
+	void compile()
+	{
+		v4_.compile();
+		v6_.compile();
+	}
+
+	bool contains(const boost::asio::ip::address_v4& address) const { return v4_.contains(address.to_bytes()); }
+	bool contains(const boost::asio::ip::address_v6& address) const { return v6_.contains(address.to_bytes()); }
+
+	bool contains(const boost::asio::ip::address& address) const
+	{
+		return address.is_v4() ? contains(address.to_v4()) : contains(address.to_v6());
+	}
+};
+
+// The check made before a probe goes out: a target is permitted if the allowlist is empty or
+// contains it, and the exclusions do not. pinger, monitor, fleet_monitor, dscp_prober,
+// pmtu_prober and send_sweep() take one; the single-destination probers (size_sweeper,
+// bandwidth_prober and paced_pinger) do not, and their callers must check the target first.
+
+class target_filter
+{
+public:
+	prefix_set exclusions_;
+	prefix_set allowlist_;
+
+	template <typename Address>
+	bool permits(const Address& address) const
+	{
+		return (allowlist_.empty() || allowlist_.contains(address)) && !exclusions_.contains(address);
+	}
+};
+
+#endif // PREFIX_SET_HPP
@@ -0,0 +1,344 @@
+//
+// probe_table.hpp : flat open-addressing table of outstanding probes for reply matching
+//
+
+#ifndef PROBE_TABLE_HPP
+#define PROBE_TABLE_HPP
+
+#include "ping.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PROBE_TABLE_SSE2
+#endif
+
+// probe_table class
+//
+// Outstanding probes keyed by (destination, identifier, sequence number), with their send
+// times and the index of the target they went to, in one preallocated array of slots and no
+// allocation after construction.
+//
+// Every slot has a metadata byte in a separate array: 0x80 when empty, otherwise 7 bits of the
+// key's hash. A lookup starts at the key's home slot and compares the metadata of 16 slots at a
+// time with one SSE2 instruction, so only the slots whose 7 bits match have their keys read;
+// the metadata array is a sixteenth of the size of the slots and mostly stays in cache, which
+// leaves one cache miss, on the slot itself. The first 15 metadata bytes are repeated after
+// the last ones, so a group of 16 can be loaded at any position without wrapping.
+//
+// Probing is linear, and deletion shifts the following entries back into the hole instead of
+// leaving a tombstone, so lookups never get slower as probes come and go. insert() fails when
+// the table is 7/8 full.
+
+class probe_table
+{
+private:
+	struct slot
+	{
+		uint64_t key;
+		chrono::steady_clock::time_point time_sent;
+		uint32_t target;
+	};
+
+	enum { empty = 0x80, group = 16 };
+
+	std::vector<unsigned char> control_;
+	std::vector<slot> slots_;
+	std::size_t mask_;
+	unsigned int shift_;
+	std::size_t size_;
+
+	// The home slot from the top bits of the hash, the tag from the bottom 7.
+	std::size_t home(uint64_t h) const { return static_cast<std::size_t>(h >> shift_); }
+	static unsigned char tag(uint64_t h) { return static_cast<unsigned char>(h & 0x7f); }
+
+	void set_control(std::size_t i, unsigned char c)
+	{
+		control_[i] = c;
+		if (i < group - 1)
+			control_[slots_.size() + i] = c;
+	}
+
+	// Bit k set if the metadata byte at position + k equals c.
+	unsigned int match_group(std::size_t position, unsigned char c) const
+	{
+#if defined(PROBE_TABLE_SSE2)
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&control_[position]));
+		return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(static_cast<char>(c)))));
+#else
+		unsigned int bits = 0;
+		for (std::size_t k = 0; k < group; ++k)
+			bits |= (control_[position + k] == c ? 1u : 0u) << k;
+		return bits;
+#endif
+	}
+
+	static unsigned int lowest_bit(unsigned int bits)
+	{
+		unsigned int k = 0;
+		while (!(bits & 1))
+		{
+			bits >>= 1;
+			++k;
+		}
+		return k;
+	}
+
+	// Slot of key, or npos.
+	std::size_t find(uint64_t key) const
+	{
+		uint64_t h = hash(key);
+		unsigned char t = tag(h);
+		std::size_t position = home(h);
+		for (std::size_t probed = 0; probed < slots_.size(); probed += group)
+		{
+			for (unsigned int bits = match_group(position, t); bits; bits &= bits - 1)
+			{
+				std::size_t i = (position + lowest_bit(bits)) & mask_;
+				if (slots_[i].key == key)
+					return i;
+			}
+			if (match_group(position, empty))
+				return npos;
+			position = (position + group) & mask_;
+		}
+		return npos;
+	}
+
+	// Backward shift: pulls every following entry that may sit closer to home into the hole.
+	void erase_slot(std::size_t hole)
+	{
+		std::size_t i = (hole + 1) & mask_;
+		while (control_[i] != empty)
+		{
+			std::size_t h = home(hash(slots_[i].key));
+			// The entry can move if its home is not in the cyclic range (hole, i].
+			if (((i - h) & mask_) >= ((i - hole) & mask_))
+			{
+				slots_[hole] = slots_[i];
+				set_control(hole, control_[i]);
+				hole = i;
+			}
+			i = (i + 1) & mask_;
+		}
+		set_control(hole, empty);
+		--size_;
+	}
+
+public:
+	static const std::size_t npos = static_cast<std::size_t>(-1);
+
+	// Room for at least capacity probes.
+	explicit probe_table(std::size_t capacity = 4096) : mask_(0), shift_(64 - 4), size_(0)
+	{
+		std::size_t slots = group;
+		while (slots - slots / 8 < capacity)
+		{
+			slots *= 2;
+			--shift_;
+		}
+		slots_.resize(slots);
+		control_.assign(slots + group - 1, static_cast<unsigned char>(empty));
+		mask_ = slots - 1;
+	}
+
+	// The splitmix64 finalizer: every bit of the key reaches every bit of the hash, so that keys
+	// differing only in the address, as a sweep's probes do, still spread over the table.
+	static uint64_t hash(uint64_t key)
+	{
+		key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+		return key ^ (key >> 31);
+	}
+
+	static uint64_t key(boost::asio::ip::address_v4 address, unsigned short identifier, unsigned short sequence_number)
+	{
+		return (static_cast<uint64_t>(address.to_uint()) << 32) | (static_cast<uint64_t>(identifier) << 16) | sequence_number;
+	}
+
+	std::size_t size() const { return size_; }
+	std::size_t capacity() const { return slots_.size() - slots_.size() / 8; }
+
+	// Adds a probe or updates it; false if the table is full.
+	bool insert(uint64_t key, chrono::steady_clock::time_point time_sent, uint32_t target = 0)
+	{
+		std::size_t i = find(key);
+		if (i != npos)
+		{
+			slots_[i].time_sent = time_sent;
+			slots_[i].target = target;
+			return true;
+		}
+		if (size_ >= capacity())
+			return false;
+
+		uint64_t h = hash(key);
+		std::size_t position = home(h);
+		unsigned int bits;
+		while (!(bits = match_group(position, empty)))
+			position = (position + group) & mask_;
+		i = (position + lowest_bit(bits)) & mask_;
+
+		slots_[i].key = key;
+		slots_[i].time_sent = time_sent;
+		slots_[i].target = target;
+		set_control(i, tag(h));
+		++size_;
+		return true;
+	}
+
+	// Removes the probe a reply answers and gives its send time and target.
+	bool take(uint64_t key, chrono::steady_clock::time_point& time_sent, uint32_t& target)
+	{
+		std::size_t i = find(key);
+		if (i == npos)
+			return false;
+		time_sent = slots_[i].time_sent;
+		target = slots_[i].target;
+		erase_slot(i);
+		return true;
+	}
+
+	bool take(uint64_t key, chrono::steady_clock::time_point& time_sent)
+	{
+		uint32_t target;
+		return take(key, time_sent, target);
+	}
+
+	// The send time and target of a probe still out, which stays out.
+	bool find(uint64_t key, chrono::steady_clock::time_point& time_sent, uint32_t& target) const
+	{
+		std::size_t i = find(key);
+		if (i == npos)
+			return false;
+		time_sent = slots_[i].time_sent;
+		target = slots_[i].target;
+		return true;
+	}
+
+	// Drops the probes sent before deadline and returns how many there were. Every slot is
+	// looked at; callers that expire often keep their probes in send order themselves.
+	std::size_t expire(chrono::steady_clock::time_point deadline)
+	{
+		if (!size_)
+			return 0;
+
+		// Starting after an empty slot, shifts only ever move entries to slots not yet visited,
+		// or into i, which is looked at again before moving on.
+		std::size_t start = 0;
+		while (control_[start] != empty)
+			++start;
+
+		std::size_t expired = 0;
+		for (std::size_t k = 1; k <= slots_.size(); ++k)
+		{
+			std::size_t i = (start + k) & mask_;
+			while (control_[i] != empty && slots_[i].time_sent < deadline)
+			{
+				erase_slot(i);
+				++expired;
+			}
+		}
+		return expired;
+	}
+};
+
+// address_set class
+//
+// The IPv4 addresses of a set of targets, for telling a reply from some other target of ours
+// apart from one no target could have sent. Open addressing with linear probing over 32-bit
+// slots, at most half full so that a miss ends within a slot or two; 0.0.0.0 marks an empty
+// slot and is never a member.
+
+class address_set
+{
+private:
+	std::vector<uint32_t> slots_;
+	std::size_t mask_;
+	std::size_t size_;
+
+	std::size_t home(uint32_t address) const
+	{
+		return static_cast<std::size_t>((address * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+	}
+
+public:
+	address_set() : slots_(16, 0), mask_(15), size_(0) {}
+
+	std::size_t size() const { return size_; }
+	std::size_t memory() const { return slots_.size() * sizeof(uint32_t); }
+
+	void reserve(std::size_t n)
+	{
+		std::size_t slots = slots_.size();
+		while (slots < 2 * n)
+			slots *= 2;
+		if (slots == slots_.size())
+			return;
+
+		std::vector<uint32_t> old(slots, 0);
+		old.swap(slots_);
+		mask_ = slots - 1;
+		size_ = 0;
+		for (std::size_t i = 0; i < old.size(); ++i)
+			if (old[i])
+				insert(boost::asio::ip::address_v4(old[i]));
+	}
+
+	void insert(boost::asio::ip::address_v4 address)
+	{
+		uint32_t a = address.to_uint();
+		if (!a)
+			return;
+		if (2 * (size_ + 1) > slots_.size())
+			reserve(size_ + 1);
+
+		std::size_t i = home(a);
+		while (slots_[i] && slots_[i] != a)
+			i = (i + 1) & mask_;
+		if (!slots_[i])
+		{
+			slots_[i] = a;
+			++size_;
+		}
+	}
+
+	bool contains(boost::asio::ip::address_v4 address) const
+	{
+		uint32_t a = address.to_uint();
+		for (std::size_t i = home(a); slots_[i]; i = (i + 1) & mask_)
+			if (slots_[i] == a)
+				return true;
+		return false;
+	}
+};
+
+// Times probe_table with the keys of a sweep, one sequence number for every address, against
+// keys with a sequence number each; the two should cost the same.
+void probe_table_benchmark(std::size_t probes, std::ostream& os)
+{
+	chrono::steady_clock::time_point time_sent = steady_timer::clock_type::now();
+	for (int sweep = 1; sweep >= 0; --sweep)
+	{
+		probe_table table(probes);
+		chrono::steady_clock::time_point start = steady_timer::clock_type::now();
+		for (std::size_t i = 0; i < probes; ++i)
+			table.insert(probe_table::key(boost::asio::ip::address_v4(static_cast<uint32_t>(0x0A000000 + i)), 1,
+				static_cast<unsigned short>(sweep ? 7 : i)), time_sent);
+		chrono::steady_clock::time_point inserted = steady_timer::clock_type::now();
+		std::size_t matched = 0;
+		for (std::size_t i = 0; i < probes; ++i)
+		{
+			chrono::steady_clock::time_point t;
+			matched += table.take(probe_table::key(boost::asio::ip::address_v4(static_cast<uint32_t>(0x0A000000 + i)), 1,
+				static_cast<unsigned short>(sweep ? 7 : i)), t);
+		}
+		chrono::steady_clock::time_point taken = steady_timer::clock_type::now();
+
+		os << (sweep ? " one sequence number: " : " sequence numbers:    ") << probes << " probes, "
+			<< chrono::duration<double, std::nano>(inserted - start).count() / probes << " ns per insert, "
+			<< chrono::duration<double, std::nano>(taken - inserted).count() / probes << " ns per match, "
+			<< matched << " matched\n";
+	}
+}
+
+#endif // PROBE_TABLE_HPP
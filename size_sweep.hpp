@@ -0,0 +1,241 @@
+//
+// size_sweep.hpp : RTT as a function of packet size, to tell serialization delay from queuing
+// void size_sweep_ping(hex_ip4_address, min_size, max_size, step, count, timer_millisecond, report_stream)
+//
+
+#ifndef SIZE_SWEEP_HPP
+#define SIZE_SWEEP_HPP
+
+#include "ping.hpp"
+#include <iomanip>
+#include <map>
+#include <random>
+
+// size_sweeper class
+//
+// Sends count_ echo requests of every payload size in [min_size, max_size], one probe per
+// timer_interval_, with the sizes of each round in a fresh random order so that slow drifts
+// in load do not line up with size. The minimum RTT of a size is the one probe that found the
+// queues empty, so a least squares line through the minimum RTT per size gives
+//
+//   - the slope: serialization time per byte, summed over every hop and both directions
+//     (the reply is as large as the request), hence an estimate of the path's bandwidth;
+//   - the intercept: propagation and fixed processing delay.
+//
+// What a size's mean RTT adds to its minimum is queuing delay.
+
+class size_sweeper
+{
+private:
+	struct probe
+	{
+		std::size_t size_index;
+		chrono::steady_clock::time_point time_sent;
+	};
+
+	icmp::socket socket_;
+	steady_timer timer_;
+	boost::asio::streambuf reply_buffer_;
+	icmp::endpoint destination_;
+	std::vector<std::size_t> sizes_;
+	std::vector<probe_statistics> statistics_;
+	std::vector<std::size_t> order_;
+	std::map<unsigned short, probe> outstanding_;
+	echo_payload payload_;
+	unsigned char request_header_[8];
+	unsigned short sequence_number_;
+	std::size_t sent_;
+	std::minstd_rand random_;
+
+	void send()
+	{
+		if (sent_ % sizes_.size() == 0)
+			std::shuffle(order_.begin(), order_.end(), random_);
+		std::size_t size_index = order_[sent_ % sizes_.size()];
+		++sent_;
+
+		const std::vector<unsigned char>& body = payload_.next(++sequence_number_);
+		std::vector<unsigned char>::const_iterator body_end = body.begin() + sizes_[size_index];
+
+		icmp_header echo_request;
+		echo_request.type(icmp_header::echo_request);
+		echo_request.code(0);
+		echo_request.identifier(pinger::get_identifier());
+		echo_request.sequence_number(sequence_number_);
+		compute_checksum(echo_request, body.begin(), body_end);
+		echo_request.write(request_header_);
+
+		std::array<boost::asio::const_buffer, 2> request = { { boost::asio::buffer(request_header_), boost::asio::buffer(&body[0], sizes_[size_index]) } };
+
+		probe p = { size_index, steady_timer::clock_type::now() };
+		outstanding_[sequence_number_] = p;
+		statistics_[size_index].add_sent();
+		socket_.send_to(request, destination_);
+	}
+
+public:
+	std::size_t count_;
+	uint16_t timer_interval_;
+	uint16_t timeout_;
+	checksum_verifier checksums_;
+
+	size_sweeper(boost::asio::io_context& ping_io_context, boost::asio::ip::address_v4 destination,
+		std::size_t min_size, std::size_t max_size, std::size_t step, echo_payload::kind payload_kind = echo_payload::random_bytes)
+		: socket_(ping_io_context, icmp::v4()), timer_(ping_io_context), destination_(destination, 0),
+		payload_(std::max<std::size_t>(max_size, 1), payload_kind), sequence_number_(0), sent_(0),
+		count_(10), timer_interval_(100), timeout_(1000)
+	{
+		for (std::size_t size = min_size; size <= max_size; size += std::max<std::size_t>(step, 1))
+		{
+			order_.push_back(sizes_.size());
+			sizes_.push_back(size);
+		}
+		statistics_.resize(sizes_.size());
+	}
+
+	void start_send()
+	{
+		if (sizes_.empty() || sent_ >= count_ * sizes_.size())
+		{
+			socket_.close();
+			return;
+		}
+
+		send();
+
+		// After the last probe, wait for the timeout instead of the interval.
+		bool last = sent_ >= count_ * sizes_.size();
+		timer_.expires_after(chrono::milliseconds(last ? timeout_ : timer_interval_));
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_timeout lambda
+				if (!error)
+					start_send();
+			});
+	}
+
+	void handle_reply(const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr)
+	{
+		if (icmp_hdr.type() != icmp_header::echo_reply || icmp_hdr.identifier() != pinger::get_identifier()
+			|| ipv4_hdr.source_address() != destination_.address().to_v4())
+			return;
+
+		std::map<unsigned short, probe>::iterator it = outstanding_.find(icmp_hdr.sequence_number());
+		if (it == outstanding_.end())
+			return;
+
+		statistics_[it->second.size_index].add_reply(steady_timer::clock_type::now() - it->second.time_sent);
+		outstanding_.erase(it);
+	}
+
+	void start_receive()
+	{
+		reply_buffer_.consume(reply_buffer_.size());
+
+		socket_.async_receive(reply_buffer_.prepare(1024), [this](const boost::system::error_code& error, std::size_t bytes_transferred)
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				reply_buffer_.commit(bytes_transferred);
+
+				if (checksums_.verify_icmp(static_cast<const unsigned char*>(reply_buffer_.data().data()), bytes_transferred, 1024))
+				{
+					std::istream is(&reply_buffer_);
+					ipv4_header ipv4_hdr;
+					icmp_header icmp_hdr;
+					is >> ipv4_hdr >> icmp_hdr;
+
+					if (is)
+						handle_reply(ipv4_hdr, icmp_hdr);
+				}
+
+				start_receive();
+			});
+	}
+
+	std::size_t sizes() const { return sizes_.size(); }
+	std::size_t size(std::size_t size_index) const { return sizes_[size_index]; }
+	const probe_statistics& statistics(std::size_t size_index) const { return statistics_[size_index]; }
+
+	// Least squares line through the minimum RTT of every size that got a reply.
+	bool fit(double& ms_per_byte, double& base_ms) const
+	{
+		double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+		for (std::size_t i = 0; i < sizes_.size(); ++i)
+		{
+			if (statistics_[i].received() == 0)
+				continue;
+			double x = static_cast<double>(sizes_[i]);
+			double y = statistics_[i].min_rtt();
+			n += 1;
+			sx += x;
+			sy += y;
+			sxx += x * x;
+			sxy += x * y;
+		}
+
+		double d = n * sxx - sx * sx;
+		if (n < 2 || d == 0)
+			return false;
+		ms_per_byte = (n * sxy - sx * sy) / d;
+		base_ms = (sy - ms_per_byte * sx) / n;
+		return true;
+	}
+
+	// Bits per second the slope stands for, 0 if there is no usable slope.
+	double bandwidth() const
+	{
+		double ms_per_byte = 0, base_ms = 0;
+		if (!fit(ms_per_byte, base_ms) || ms_per_byte <= 0)
+			return 0;
+		return 2 * 8 * 1000 / ms_per_byte;
+	}
+
+	void report(std::ostream& os) const
+	{
+		os << std::fixed << std::setprecision(3);
+		for (std::size_t i = 0; i < sizes_.size(); ++i)
+		{
+			const probe_statistics& s = statistics_[i];
+			os << " size " << sizes_[i] << ": received " << s.received() << "/" << s.sent();
+			if (s.received())
+				os << ", rtt min " << s.min_rtt() << " mean " << s.mean_rtt() << " msec, queuing " << s.mean_rtt() - s.min_rtt() << " msec";
+			os << "\n";
+		}
+
+		double ms_per_byte = 0, base_ms = 0;
+		if (fit(ms_per_byte, base_ms))
+			os << " serialization " << ms_per_byte * 1000 << " usec/byte, base " << base_ms
+				<< " msec, bandwidth " << bandwidth() / 1e6 << " Mbit/s\n";
+		if (checksums_.corrupted())
+			os << " corrupted " << checksums_.corrupted() << "\n";
+	}
+};
+
+void size_sweep_ping(uint32_t address, std::size_t min_size, std::size_t max_size, std::size_t step,
+	uint8_t count, uint16_t timer_milliseconds, std::ostream& os)
+{
+	boost::asio::io_context ping_io_context;
+
+	try
+	{
+		size_sweeper s(ping_io_context, boost::asio::ip::address_v4(address), min_size, max_size, step);
+		s.count_ = count;
+		s.timer_interval_ = timer_milliseconds;
+
+		s.start_send();
+		s.start_receive();
+
+		ping_io_context.run();
+
+		s.report(os);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+}
+
+#endif // SIZE_SWEEP_HPP
@@ -0,0 +1,415 @@
+//
+// target_table.hpp : compact structure-of-arrays target table for monitoring millions of targets
+// void fleet_ping(hex_ip4_addresses, count, interval_millisecond, slack_millisecond, report_stream)
+//
+
+#ifndef TARGET_TABLE_HPP
+#define TARGET_TABLE_HPP
+
+#include "ping.hpp"
+#include "probe_table.hpp"
+#include <iomanip>
+#include <limits>
+
+// target_table class
+//
+// The state of every target, one array per field, so that the loops that only need a field or
+// two stream through those and nothing else. Times are 32-bit offsets from the table's epoch:
+// schedule times in milliseconds, send times in microseconds, both compared modulo 2^32 so
+// that they wrap safely as long as intervals stay under 24 days and RTTs under 35 minutes.
+// RTT statistics are Welford's running mean and sum of squares in single precision.
+//
+// bytes_per_target() is what the table costs per target: 44 bytes. A fleet_monitor adds its
+// own per-target state on top, see fleet_monitor::bytes_per_target().
+
+class target_table
+{
+private:
+	chrono::steady_clock::time_point epoch_;
+
+public:
+	// Scheduling: the loop over next_send_ is the hot one.
+	std::vector<uint32_t> next_send_;
+	std::vector<uint32_t> interval_;
+
+	// Matching: address, the send time and generation of the probe out, if any.
+	std::vector<uint32_t> address_;
+	std::vector<uint32_t> sent_at_;
+	std::vector<uint16_t> generation_;
+	std::vector<unsigned char> outstanding_;
+	std::vector<unsigned char> losses_in_row_;
+
+	// Results.
+	std::vector<uint32_t> sent_;
+	std::vector<uint32_t> received_;
+	std::vector<float> mean_rtt_;
+	std::vector<float> m2_rtt_;
+	std::vector<float> min_rtt_;
+	std::vector<float> max_rtt_;
+
+	target_table() : epoch_(steady_timer::clock_type::now()) {}
+
+	static std::size_t bytes_per_target()
+	{
+		return 4 * sizeof(uint32_t) + sizeof(uint16_t) + 2 * sizeof(unsigned char) + 2 * sizeof(uint32_t) + 4 * sizeof(float);
+	}
+
+	std::size_t size() const { return address_.size(); }
+
+	void reserve(std::size_t n)
+	{
+		next_send_.reserve(n);
+		interval_.reserve(n);
+		address_.reserve(n);
+		sent_at_.reserve(n);
+		generation_.reserve(n);
+		outstanding_.reserve(n);
+		losses_in_row_.reserve(n);
+		sent_.reserve(n);
+		received_.reserve(n);
+		mean_rtt_.reserve(n);
+		m2_rtt_.reserve(n);
+		min_rtt_.reserve(n);
+		max_rtt_.reserve(n);
+	}
+
+	std::size_t add(boost::asio::ip::address_v4 address, uint32_t interval_milliseconds, uint32_t first_send_milliseconds = 0)
+	{
+		next_send_.push_back(first_send_milliseconds);
+		interval_.push_back(interval_milliseconds);
+		address_.push_back(address.to_uint());
+		sent_at_.push_back(0);
+		generation_.push_back(0);
+		outstanding_.push_back(0);
+		losses_in_row_.push_back(0);
+		sent_.push_back(0);
+		received_.push_back(0);
+		mean_rtt_.push_back(0);
+		m2_rtt_.push_back(0);
+		min_rtt_.push_back(std::numeric_limits<float>::max());
+		max_rtt_.push_back(0);
+		return address_.size() - 1;
+	}
+
+	uint32_t milliseconds(chrono::steady_clock::time_point t) const
+	{
+		return static_cast<uint32_t>(chrono::duration_cast<chrono::milliseconds>(t - epoch_).count());
+	}
+
+	uint32_t microseconds(chrono::steady_clock::time_point t) const
+	{
+		return static_cast<uint32_t>(chrono::duration_cast<chrono::microseconds>(t - epoch_).count());
+	}
+
+	// a is at or before b, modulo 2^32.
+	static bool not_after(uint32_t a, uint32_t b) { return static_cast<int32_t>(a - b) <= 0; }
+
+	void add_reply(std::size_t i, float rtt_milliseconds)
+	{
+		++received_[i];
+		float delta = rtt_milliseconds - mean_rtt_[i];
+		mean_rtt_[i] += delta / received_[i];
+		m2_rtt_[i] += delta * (rtt_milliseconds - mean_rtt_[i]);
+		min_rtt_[i] = std::min(min_rtt_[i], rtt_milliseconds);
+		max_rtt_[i] = std::max(max_rtt_[i], rtt_milliseconds);
+		losses_in_row_[i] = 0;
+	}
+
+	void add_loss(std::size_t i)
+	{
+		if (losses_in_row_[i] < 255)
+			++losses_in_row_[i];
+	}
+
+	double stddev_rtt(std::size_t i) const { return received_[i] > 1 ? std::sqrt(m2_rtt_[i] / (received_[i] - 1)) : 0; }
+};
+
+// fleet_monitor class
+//
+// The monitor's scheduling on slots of slack_ milliseconds, for a target_table: every wakeup is
+// one pass over the table, in order, that expires the probes timed out and sends the ones due.
+// No per-probe map is kept: the echo body carries the target's index and the probe's
+// generation, and a reply is matched by reading them back and checking the source address,
+// the generation and the outstanding flag of that one entry. A reply that matches all but the
+// source address counts as misdirected if the source is another target, spoofed otherwise.
+// A target has one probe out at most: with an interval of timeout_ or less, a probe still
+// unanswered when the next one is due is lost then, and its reply is no longer matched.
+// Targets filter_ refuses at start() are never probed.
+
+class fleet_monitor
+{
+private:
+	icmp::socket socket_;
+	steady_timer timer_;
+	boost::asio::streambuf reply_buffer_;
+	target_table& table_;
+	unsigned char request_[8 + 8];
+	std::size_t wakeups_;
+	address_set addresses_;
+	std::vector<unsigned char> excluded_;
+	std::size_t misdirected_;
+	std::size_t spoofed_;
+
+	void send(std::size_t i, uint32_t now_us)
+	{
+		uint32_t index = static_cast<uint32_t>(i);
+		uint16_t generation = ++table_.generation_[i];
+
+		unsigned char* body = request_ + 8;
+		std::memcpy(body, &index, 4);
+		std::memcpy(body + 4, &now_us, 4);
+
+		icmp_header echo_request;
+		echo_request.type(icmp_header::echo_request);
+		echo_request.code(0);
+		echo_request.identifier(pinger::get_identifier());
+		echo_request.sequence_number(generation);
+		compute_checksum(echo_request, body, body + 8);
+		echo_request.write(request_);
+
+		// The table has room for one probe out per target, so one still unanswered is lost.
+		if (table_.outstanding_[i])
+			table_.add_loss(i);
+		table_.sent_at_[i] = now_us;
+		table_.outstanding_[i] = 1;
+		++table_.sent_[i];
+
+		boost::system::error_code error;
+		socket_.send_to(boost::asio::buffer(request_), icmp::endpoint(boost::asio::ip::address_v4(table_.address_[i]), 0), 0, error);
+	}
+
+	void wakeup()
+	{
+		chrono::steady_clock::time_point now = steady_timer::clock_type::now();
+		uint32_t now_ms = table_.milliseconds(now);
+		uint32_t now_us = table_.microseconds(now);
+		uint32_t timeout_us = static_cast<uint32_t>(timeout_) * 1000;
+		++wakeups_;
+
+		// One pass: expire, send, and find the next event, all in table order.
+		bool pending = false;
+		uint32_t next = now_ms + 0x7fffffff;
+		std::size_t n = table_.size();
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			if (!excluded_.empty() && excluded_[i])
+				continue;
+
+			if (table_.outstanding_[i])
+			{
+				uint32_t waited_us = now_us - table_.sent_at_[i];
+				if (waited_us >= timeout_us)
+				{
+					table_.outstanding_[i] = 0;
+					table_.add_loss(i);
+				}
+				else
+				{
+					pending = true;
+					uint32_t deadline = now_ms + (timeout_us - waited_us) / 1000 + 1;
+					if (target_table::not_after(deadline, next))
+						next = deadline;
+				}
+			}
+
+			if (count_ && table_.sent_[i] >= count_)
+				continue;
+
+			if (target_table::not_after(table_.next_send_[i], now_ms))
+			{
+				send(i, now_us);
+				table_.next_send_[i] += table_.interval_[i];
+				if (target_table::not_after(table_.next_send_[i], now_ms))
+					table_.next_send_[i] = now_ms + table_.interval_[i];
+				pending = true;
+				uint32_t deadline = now_ms + timeout_ + 1;
+				if (target_table::not_after(deadline, next))
+					next = deadline;
+				if (count_ && table_.sent_[i] >= count_)
+					continue;
+			}
+
+			pending = true;
+			if (target_table::not_after(table_.next_send_[i], next))
+				next = table_.next_send_[i];
+		}
+
+		if (!pending)
+		{
+			socket_.close();
+			return;
+		}
+
+		chrono::steady_clock::time_point at = now + chrono::milliseconds(static_cast<int32_t>(next - now_ms));
+		if (slack_ > 0)
+		{
+			chrono::steady_clock::duration slot = chrono::milliseconds(slack_);
+			chrono::steady_clock::duration since_epoch = at.time_since_epoch() + slot - chrono::steady_clock::duration(1);
+			at = chrono::steady_clock::time_point(since_epoch - since_epoch % slot);
+		}
+
+		timer_.expires_at(at);
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_timeout lambda
+				if (!error)
+					wakeup();
+			});
+	}
+
+public:
+	std::size_t count_;
+	uint16_t timeout_;
+	uint16_t slack_;
+	checksum_verifier checksums_;
+	const target_filter* filter_;
+
+	fleet_monitor(boost::asio::io_context& ping_io_context, target_table& table)
+		: socket_(ping_io_context, icmp::v4()), timer_(ping_io_context), table_(table), wakeups_(0), misdirected_(0), spoofed_(0),
+		count_(0), timeout_(1000), slack_(100), filter_(0)
+	{
+	}
+
+	void start()
+	{
+		addresses_.reserve(table_.size());
+		for (std::size_t i = 0; i < table_.size(); ++i)
+			addresses_.insert(boost::asio::ip::address_v4(table_.address_[i]));
+
+		// One byte per target, and only when there is a filter to apply.
+		excluded_.clear();
+		if (filter_)
+		{
+			excluded_.resize(table_.size());
+			for (std::size_t i = 0; i < table_.size(); ++i)
+				excluded_[i] = !filter_->permits(boost::asio::ip::address_v4(table_.address_[i]));
+		}
+
+		wakeup();
+		start_receive();
+	}
+
+	void handle_reply(const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr, std::istream& is)
+	{
+		if (icmp_hdr.type() != icmp_header::echo_reply || icmp_hdr.identifier() != pinger::get_identifier())
+			return;
+
+		unsigned char body[8];
+		if (!is.read(reinterpret_cast<char*>(body), 8))
+			return;
+		uint32_t index;
+		std::memcpy(&index, body, 4);
+
+		if (index >= table_.size() || !table_.outstanding_[index] || table_.generation_[index] != icmp_hdr.sequence_number())
+			return;
+
+		if (table_.address_[index] != ipv4_hdr.source_address().to_uint())
+		{
+			if (addresses_.contains(ipv4_hdr.source_address()))
+				++misdirected_;
+			else
+				++spoofed_;
+			return;
+		}
+
+		uint32_t now_us = table_.microseconds(steady_timer::clock_type::now());
+		table_.outstanding_[index] = 0;
+		table_.add_reply(index, (now_us - table_.sent_at_[index]) / 1000.0f);
+	}
+
+	void start_receive()
+	{
+		reply_buffer_.consume(reply_buffer_.size());
+
+		socket_.async_receive(reply_buffer_.prepare(1024), [this](const boost::system::error_code& error, std::size_t bytes_transferred)
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				reply_buffer_.commit(bytes_transferred);
+
+				if (checksums_.verify_icmp(static_cast<const unsigned char*>(reply_buffer_.data().data()), bytes_transferred, 1024))
+				{
+					std::istream is(&reply_buffer_);
+					ipv4_header ipv4_hdr;
+					icmp_header icmp_hdr;
+					is >> ipv4_hdr >> icmp_hdr;
+
+					if (is)
+						handle_reply(ipv4_hdr, icmp_hdr, is);
+				}
+
+				start_receive();
+			});
+	}
+
+	std::size_t wakeups() const { return wakeups_; }
+
+	// The whole cost of a target once started, rounded up: the table's 44 bytes, 8 to 16 more
+	// for the address set, which is at most half full (more below its 16 slots), and with a
+	// filter one byte for the exclusion.
+	std::size_t bytes_per_target() const
+	{
+		std::size_t n = std::max<std::size_t>(table_.size(), 1);
+		return target_table::bytes_per_target() + (addresses_.memory() + excluded_.size() + n - 1) / n;
+	}
+
+	bool excluded(std::size_t i) const { return !excluded_.empty() && excluded_[i]; }
+	std::size_t misdirected() const { return misdirected_; }
+	std::size_t spoofed() const { return spoofed_; }
+
+	void report(std::ostream& os) const
+	{
+		std::size_t sent = 0, received = 0, up = 0, refused = 0;
+		for (std::size_t i = 0; i < table_.size(); ++i)
+		{
+			refused += excluded(i);
+			sent += table_.sent_[i];
+			received += table_.received_[i];
+			up += table_.received_[i] && table_.losses_in_row_[i] == 0;
+		}
+		os << std::fixed << std::setprecision(3)
+			<< " targets " << table_.size() << " (" << bytes_per_target() << " bytes each), up " << up
+			<< ", sent " << sent << ", received " << received << ", wakeups " << wakeups_;
+		if (refused)
+			os << ", excluded " << refused;
+		if (misdirected_ || spoofed_)
+			os << ", misdirected " << misdirected_ << ", spoofed " << spoofed_;
+		if (checksums_.corrupted())
+			os << ", corrupted " << checksums_.corrupted();
+		os << "\n";
+	}
+};
+
+void fleet_ping(const std::vector<uint32_t>& addresses, std::size_t count, uint32_t interval_milliseconds,
+	uint16_t slack_milliseconds, std::ostream& os)
+{
+	boost::asio::io_context ping_io_context;
+
+	try
+	{
+		// Phases spread evenly over the interval, as monitor does.
+		target_table table;
+		table.reserve(addresses.size());
+		for (std::size_t i = 0; i < addresses.size(); ++i)
+			table.add(boost::asio::ip::address_v4(addresses[i]), interval_milliseconds,
+				static_cast<uint32_t>(static_cast<uint64_t>(interval_milliseconds) * i / addresses.size()));
+
+		fleet_monitor f(ping_io_context, table);
+		f.count_ = count;
+		f.slack_ = slack_milliseconds;
+
+		f.start();
+
+		ping_io_context.run();
+
+		f.report(os);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+}
+
+#endif // TARGET_TABLE_HPP
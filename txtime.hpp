@@ -0,0 +1,298 @@
+//
+// txtime.hpp : probes released by the kernel at absolute launch times (SO_TXTIME, Linux only)
+// void paced_ping(hex_ip4_address, count, timer_millisecond, report_stream)
+//
+
+#ifndef TXTIME_HPP
+#define TXTIME_HPP
+
+#include "packet_ring.hpp"
+
+#if defined(__linux__)
+
+#include <linux/net_tstamp.h>
+#include <iomanip>
+#include <map>
+
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+// Sends datagrams on a socket with SO_TXTIME set, each with the launch time it carries.
+//
+// The launch time is in nanoseconds on the given clock and only means something to a qdisc
+// that honours it: fq (CLOCK_MONOTONIC, the default) holds each packet until its time, etf
+// (CLOCK_TAI, usually) does the same and can hand the time on to NICs with launch time
+// offload. Any other qdisc sends at once. On Linux the steady clock is CLOCK_MONOTONIC, so
+// with the default clock a launch time is a steady_clock time point.
+//
+// The socket is the caller's; the sender only keeps its descriptor.
+
+class txtime_sender
+{
+private:
+	int fd_;
+	clockid_t clock_;
+
+public:
+	txtime_sender(int fd, clockid_t clock = CLOCK_MONOTONIC, bool deadline_mode = false) : fd_(fd), clock_(clock)
+	{
+		sock_txtime config;
+		config.clockid = clock;
+		config.flags = deadline_mode ? SOF_TXTIME_DEADLINE_MODE : 0;
+		if (::setsockopt(fd_, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) < 0)
+			throw_errno("SO_TXTIME");
+	}
+
+	clockid_t clock() const { return clock_; }
+
+	uint64_t now() const
+	{
+		timespec t;
+		::clock_gettime(clock_, &t);
+		return static_cast<uint64_t>(t.tv_sec) * 1000000000 + t.tv_nsec;
+	}
+
+	static uint64_t launch_time(chrono::steady_clock::time_point t)
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch()).count();
+	}
+
+	template <typename ConstBufferSequence>
+	void send_to(const ConstBufferSequence& buffers, const icmp::endpoint& destination, uint64_t launch_time)
+	{
+		iovec iov[4];
+		std::size_t count = 0;
+		for (typename ConstBufferSequence::const_iterator it = buffers.begin(); it != buffers.end() && count < 4; ++it, ++count)
+		{
+			boost::asio::const_buffer b(*it);
+			iov[count].iov_base = const_cast<void*>(b.data());
+			iov[count].iov_len = b.size();
+		}
+
+		char control[CMSG_SPACE(sizeof(uint64_t))];
+		std::memset(control, 0, sizeof(control));
+		msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_name = const_cast<sockaddr*>(destination.data());
+		message.msg_namelen = static_cast<socklen_t>(destination.size());
+		message.msg_iov = iov;
+		message.msg_iovlen = count;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+		std::memcpy(CMSG_DATA(cmsg), &launch_time, sizeof(launch_time));
+
+		if (::sendmsg(fd_, &message, 0) < 0)
+			throw_errno("sendmsg");
+	}
+};
+
+// paced_pinger class
+//
+// Echo requests one timer_interval_ apart, queued batch_ at a time: every wakeup hands the
+// kernel the next batch_ probes with their launch times, lead_ ahead of the first one, and the
+// next wakeup comes lead_ before the next batch is due. The send times are the launch times,
+// not whenever a handler got to run, so neither the spacing of the probes nor their RTTs carry
+// the reactor's jitter. Replies are matched by sequence number against every probe still out.
+//
+// fq drops packets whose launch time is more than its horizon ahead (10 s by default), so a
+// batch is cut short to keep its last launch time under horizon_ from now: at long intervals
+// the probes go out fewer at a time, down to one per wakeup.
+
+class paced_pinger
+{
+private:
+	icmp::socket socket_;
+	steady_timer timer_;
+	boost::asio::streambuf reply_buffer_;
+	icmp::endpoint destination_;
+	txtime_sender sender_;
+	echo_payload payload_;
+	unsigned char request_header_[8];
+	std::map<unsigned short, chrono::steady_clock::time_point> outstanding_;
+	probe_statistics statistics_;
+	chrono::steady_clock::time_point next_launch_;
+	unsigned short sequence_number_;
+	std::size_t sent_;
+	std::size_t unpaced_;
+
+	void expire(chrono::steady_clock::time_point deadline)
+	{
+		for (std::map<unsigned short, chrono::steady_clock::time_point>::iterator it = outstanding_.begin(); it != outstanding_.end();)
+		{
+			if (it->second < deadline)
+				outstanding_.erase(it++);
+			else
+				++it;
+		}
+	}
+
+public:
+	std::size_t count_;
+	uint16_t timer_interval_;
+	uint16_t timeout_;
+	std::size_t batch_;
+	chrono::microseconds lead_;
+	chrono::microseconds horizon_;
+	checksum_verifier checksums_;
+
+	paced_pinger(boost::asio::io_context& ping_io_context, boost::asio::ip::address_v4 destination, clockid_t clock = CLOCK_MONOTONIC)
+		: socket_(ping_io_context, icmp::v4()), timer_(ping_io_context), destination_(destination, 0),
+		sender_(socket_.native_handle(), clock), sequence_number_(0), sent_(0), unpaced_(0),
+		count_(10), timer_interval_(1000), timeout_(1000), batch_(8), lead_(2000), horizon_(10000000)
+	{
+	}
+
+	void start_send()
+	{
+		chrono::steady_clock::time_point now = steady_timer::clock_type::now();
+		expire(now - chrono::milliseconds(timeout_));
+
+		if (sent_ >= count_)
+		{
+			socket_.close();
+			return;
+		}
+
+		if (sent_ == 0)
+			next_launch_ = now + lead_;
+
+		// sendmsg copies every request, so one header buffer serves the whole batch.
+		std::size_t batch = std::min(std::max<std::size_t>(batch_, 1), count_ - sent_);
+		if (timer_interval_ > 0)
+		{
+			chrono::steady_clock::duration room = horizon_ - std::max(next_launch_ - now, chrono::steady_clock::duration::zero());
+			if (room > chrono::steady_clock::duration::zero())
+				batch = std::min<std::size_t>(batch, 1 + (room - chrono::steady_clock::duration(1)) / chrono::milliseconds(timer_interval_));
+			else
+				batch = 1;
+		}
+		for (std::size_t i = 0; i < batch; ++i, ++sent_)
+		{
+			const std::vector<unsigned char>& body = payload_.next(++sequence_number_);
+
+			icmp_header echo_request;
+			echo_request.type(icmp_header::echo_request);
+			echo_request.code(0);
+			echo_request.identifier(pinger::get_identifier());
+			echo_request.sequence_number(sequence_number_);
+			compute_checksum(echo_request, body.begin(), body.end());
+			echo_request.write(request_header_);
+
+			std::array<boost::asio::const_buffer, 2> request = { { boost::asio::buffer(request_header_), boost::asio::buffer(body) } };
+
+			outstanding_[sequence_number_] = next_launch_;
+			statistics_.add_sent();
+			sender_.send_to(request, destination_, sender_.clock() == CLOCK_MONOTONIC
+				? txtime_sender::launch_time(next_launch_)
+				: sender_.now() + chrono::duration_cast<chrono::nanoseconds>(next_launch_ - now).count());
+			next_launch_ += chrono::milliseconds(timer_interval_);
+		}
+
+		// After the last batch, wait for the last probe's timeout.
+		timer_.expires_at(sent_ < count_ ? next_launch_ - lead_ : next_launch_ - chrono::milliseconds(timer_interval_) + chrono::milliseconds(timeout_));
+		timer_.async_wait([this](const boost::system::error_code& error)
+			{
+				//handle_timeout lambda
+				if (!error)
+					start_send();
+			});
+	}
+
+	void handle_reply(const ipv4_header& ipv4_hdr, const icmp_header& icmp_hdr)
+	{
+		if (icmp_hdr.type() != icmp_header::echo_reply || icmp_hdr.identifier() != pinger::get_identifier()
+			|| ipv4_hdr.source_address() != destination_.address().to_v4())
+			return;
+
+		std::map<unsigned short, chrono::steady_clock::time_point>::iterator it = outstanding_.find(icmp_hdr.sequence_number());
+		if (it == outstanding_.end())
+			return;
+
+		// A reply from before its request's launch time means the qdisc sent it at once.
+		chrono::steady_clock::duration rtt = steady_timer::clock_type::now() - it->second;
+		if (rtt < chrono::steady_clock::duration::zero())
+			++unpaced_;
+		else
+			statistics_.add_reply(rtt);
+		outstanding_.erase(it);
+	}
+
+	void start_receive()
+	{
+		reply_buffer_.consume(reply_buffer_.size());
+
+		socket_.async_receive(reply_buffer_.prepare(1024), [this](const boost::system::error_code& error, std::size_t bytes_transferred)
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				reply_buffer_.commit(bytes_transferred);
+
+				if (checksums_.verify_icmp(static_cast<const unsigned char*>(reply_buffer_.data().data()), bytes_transferred, 1024))
+				{
+					std::istream is(&reply_buffer_);
+					ipv4_header ipv4_hdr;
+					icmp_header icmp_hdr;
+					is >> ipv4_hdr >> icmp_hdr;
+
+					if (is)
+						handle_reply(ipv4_hdr, icmp_hdr);
+				}
+
+				start_receive();
+			});
+	}
+
+	const probe_statistics& statistics() const { return statistics_; }
+
+	// Replies that came back before their launch time, left out of the statistics.
+	std::size_t unpaced() const { return unpaced_; }
+
+	void report(std::ostream& os) const
+	{
+		os << std::fixed << std::setprecision(3)
+			<< " sent " << statistics_.sent() << ", received " << statistics_.received()
+			<< ", rtt min/mean/max/stddev " << statistics_.min_rtt() << "/" << statistics_.mean_rtt()
+			<< "/" << statistics_.max_rtt() << "/" << statistics_.stddev_rtt() << " msec";
+		if (unpaced_)
+			os << ", " << unpaced_ << " sent before their launch time (no fq or etf qdisc?)";
+		if (checksums_.corrupted())
+			os << ", corrupted " << checksums_.corrupted();
+		os << "\n";
+	}
+};
+
+void paced_ping(uint32_t address, std::size_t count, uint16_t timer_milliseconds, std::ostream& os)
+{
+	boost::asio::io_context ping_io_context;
+
+	try
+	{
+		paced_pinger p(ping_io_context, boost::asio::ip::address_v4(address));
+		p.count_ = count;
+		p.timer_interval_ = timer_milliseconds;
+
+		p.start_send();
+		p.start_receive();
+
+		ping_io_context.run();
+
+		p.report(os);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+}
+
+#endif // __linux__
+
+#endif // TXTIME_HPP
@@ -0,0 +1,416 @@
+//
+// xdp_socket.hpp : AF_XDP transport for line-rate ping sweeps (Linux only)
+//
+
+#ifndef XDP_SOCKET_HPP
+#define XDP_SOCKET_HPP
+
+#include "packet_ring.hpp"
+
+#if defined(__linux__)
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <sys/syscall.h>
+#include <cstddef>
+
+// AF_XDP socket for echo requests and replies.
+//
+// Frames live in a UMEM area shared with the kernel: the first half of it is lent to the
+// kernel through the fill ring for replies, the second half holds requests on their way out.
+// A small XDP program on the interface redirects ICMP echo replies carrying our identifier to
+// the socket and passes everything else up the stack untouched.
+//
+// Requests are whole echo_frame Ethernet frames, so send() and flush() work with send_sweep()
+// the same way as a packet_tx_ring. Replies are handed to handler(ipv4_hdr, icmp_hdr) by
+// poll() or async_receive(), the same way as a packet_rx_ring.
+//
+// In SKB (generic) mode, the default, any interface works, including one end of a veth pair;
+// native mode needs driver support but skips the socket buffer allocation.
+
+class xdp_socket
+{
+private:
+	struct ring
+	{
+		uint32_t* producer;
+		uint32_t* consumer;
+		void* descriptors;
+		uint32_t size;
+		void* area;
+		std::size_t length;
+	};
+
+	boost::asio::posix::stream_descriptor descriptor_;
+	int map_fd_;
+	int program_fd_;
+	int link_fd_;
+	unsigned char* umem_;
+	unsigned int frame_size_;
+	unsigned int frame_count_;
+	ring fill_;
+	ring completion_;
+	ring rx_;
+	ring tx_;
+	std::vector<uint64_t> free_frames_;
+	std::size_t pending_;
+
+	static long bpf(int command, bpf_attr& attr)
+	{
+		return ::syscall(__NR_bpf, command, &attr, sizeof(attr));
+	}
+
+	static bpf_insn instruction(unsigned char code, unsigned char dst, unsigned char src, short off, int imm)
+	{
+		bpf_insn insn;
+		insn.code = code;
+		insn.dst_reg = dst;
+		insn.src_reg = src;
+		insn.off = off;
+		insn.imm = imm;
+		return insn;
+	}
+
+	void load_program(unsigned short identifier)
+	{
+		bpf_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.map_type = BPF_MAP_TYPE_XSKMAP;
+		attr.key_size = 4;
+		attr.value_size = 4;
+		attr.max_entries = 64;
+		map_fd_ = static_cast<int>(bpf(BPF_MAP_CREATE, attr));
+		if (map_fd_ < 0)
+			throw_errno("BPF_MAP_CREATE");
+
+		// Packet bytes are loaded in network order, so compare them against network order constants.
+		const int pass = 24;
+		bpf_insn code[] = {
+			instruction(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),						// r6 = ctx
+			instruction(BPF_LDX | BPF_MEM | BPF_W, 2, 6, offsetof(xdp_md, data), 0),
+			instruction(BPF_LDX | BPF_MEM | BPF_W, 3, 6, offsetof(xdp_md, data_end), 0),
+			instruction(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+			instruction(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14 + 20 + 8),
+			instruction(BPF_JMP | BPF_JGT | BPF_X, 4, 3, pass - 6, 0),				// too short
+			instruction(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 12, 0),
+			instruction(BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 8, htons(ETH_P_IP)),
+			instruction(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 14, 0),
+			instruction(BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 10, 0x45),				// IPv4 without options
+			instruction(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 23, 0),
+			instruction(BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 12, IPPROTO_ICMP),
+			instruction(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 20, 0),
+			instruction(BPF_JMP | BPF_JSET | BPF_K, 5, 0, pass - 14, htons(0x1FFF)),	// fragment
+			instruction(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 34, 0),
+			instruction(BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 16, icmp_header::echo_reply),
+			instruction(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 38, 0),
+			instruction(BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 18, htons(identifier)),
+			instruction(BPF_LDX | BPF_MEM | BPF_W, 2, 6, offsetof(xdp_md, rx_queue_index), 0),
+			instruction(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd_),	// r1 = map
+			instruction(0, 0, 0, 0, 0),
+			instruction(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),				// if the queue has no socket
+			instruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+			instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+			instruction(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),				// pass:
+			instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+		};
+		static const char license[] = "Dual BSD/GPL";
+
+		std::memset(&attr, 0, sizeof(attr));
+		attr.prog_type = BPF_PROG_TYPE_XDP;
+		attr.expected_attach_type = BPF_XDP;
+		attr.insns = reinterpret_cast<uint64_t>(code);
+		attr.insn_cnt = sizeof(code) / sizeof(code[0]);
+		attr.license = reinterpret_cast<uint64_t>(license);
+		program_fd_ = static_cast<int>(bpf(BPF_PROG_LOAD, attr));
+		if (program_fd_ < 0)
+			throw_errno("BPF_PROG_LOAD");
+	}
+
+	void attach_program(int ifindex, bool skb_mode)
+	{
+		// The program stays attached for as long as the link is open.
+		bpf_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.link_create.prog_fd = program_fd_;
+		attr.link_create.target_ifindex = ifindex;
+		attr.link_create.attach_type = BPF_XDP;
+		attr.link_create.flags = skb_mode ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+		link_fd_ = static_cast<int>(bpf(BPF_LINK_CREATE, attr));
+		if (link_fd_ < 0)
+			throw_errno("BPF_LINK_CREATE");
+	}
+
+	void map_ring(ring& r, const xdp_ring_offset& offset, uint32_t size, std::size_t descriptor_size, off_t page_offset)
+	{
+		r.length = offset.desc + size * descriptor_size;
+		r.area = ::mmap(0, r.length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor_.native_handle(), page_offset);
+		if (r.area == MAP_FAILED)
+		{
+			r.area = 0;
+			throw_errno("mmap");
+		}
+
+		unsigned char* base = static_cast<unsigned char*>(r.area);
+		r.producer = reinterpret_cast<uint32_t*>(base + offset.producer);
+		r.consumer = reinterpret_cast<uint32_t*>(base + offset.consumer);
+		r.descriptors = base + offset.desc;
+		r.size = size;
+	}
+
+	void set_option(int name, const void* value, socklen_t length, const char* what)
+	{
+		if (::setsockopt(descriptor_.native_handle(), SOL_XDP, name, value, length) < 0)
+			throw_errno(what);
+	}
+
+	void open(const std::string& interface_name, unsigned int queue, unsigned short identifier, bool skb_mode)
+	{
+		int ifindex = ::if_nametoindex(interface_name.c_str());
+		if (ifindex == 0)
+			throw_errno("if_nametoindex");
+
+		load_program(identifier);
+
+		int fd = ::socket(AF_XDP, SOCK_RAW, 0);
+		if (fd < 0)
+			throw_errno("AF_XDP socket");
+		descriptor_.assign(fd);
+
+		std::size_t umem_length = static_cast<std::size_t>(frame_size_) * frame_count_;
+		void* umem = ::mmap(0, umem_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (umem == MAP_FAILED)
+			throw_errno("mmap");
+		umem_ = static_cast<unsigned char*>(umem);
+
+		xdp_umem_reg reg;
+		std::memset(&reg, 0, sizeof(reg));
+		reg.addr = reinterpret_cast<uint64_t>(umem_);
+		reg.len = umem_length;
+		reg.chunk_size = frame_size_;
+		set_option(XDP_UMEM_REG, &reg, sizeof(reg), "XDP_UMEM_REG");
+
+		// Half of the frames for each direction; ring sizes must be powers of two.
+		uint32_t half = frame_count_ / 2;
+		set_option(XDP_UMEM_FILL_RING, &half, sizeof(half), "XDP_UMEM_FILL_RING");
+		set_option(XDP_UMEM_COMPLETION_RING, &half, sizeof(half), "XDP_UMEM_COMPLETION_RING");
+		set_option(XDP_RX_RING, &half, sizeof(half), "XDP_RX_RING");
+		set_option(XDP_TX_RING, &half, sizeof(half), "XDP_TX_RING");
+
+		xdp_mmap_offsets offsets;
+		socklen_t offsets_length = sizeof(offsets);
+		if (::getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_length) < 0)
+			throw_errno("XDP_MMAP_OFFSETS");
+
+		map_ring(fill_, offsets.fr, half, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+		map_ring(completion_, offsets.cr, half, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+		map_ring(rx_, offsets.rx, half, sizeof(xdp_desc), XDP_PGOFF_RX_RING);
+		map_ring(tx_, offsets.tx, half, sizeof(xdp_desc), XDP_PGOFF_TX_RING);
+
+		uint64_t* fill = static_cast<uint64_t*>(fill_.descriptors);
+		for (uint32_t i = 0; i < half; ++i)
+			fill[i] = static_cast<uint64_t>(i) * frame_size_;
+		__atomic_store_n(fill_.producer, *fill_.producer + half, __ATOMIC_RELEASE);
+
+		for (uint32_t i = half; i < frame_count_; ++i)
+			free_frames_.push_back(static_cast<uint64_t>(i) * frame_size_);
+
+		sockaddr_xdp address;
+		std::memset(&address, 0, sizeof(address));
+		address.sxdp_family = AF_XDP;
+		address.sxdp_ifindex = ifindex;
+		address.sxdp_queue_id = queue;
+		address.sxdp_flags = skb_mode ? XDP_COPY : 0;
+		if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+			throw_errno("AF_XDP bind");
+
+		bpf_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		uint32_t key = queue;
+		attr.map_fd = map_fd_;
+		attr.key = reinterpret_cast<uint64_t>(&key);
+		attr.value = reinterpret_cast<uint64_t>(&fd);
+		if (bpf(BPF_MAP_UPDATE_ELEM, attr) < 0)
+			throw_errno("BPF_MAP_UPDATE_ELEM");
+
+		attach_program(ifindex, skb_mode);
+	}
+
+	void release()
+	{
+		if (link_fd_ >= 0)
+			::close(link_fd_);
+		if (program_fd_ >= 0)
+			::close(program_fd_);
+		if (map_fd_ >= 0)
+			::close(map_fd_);
+
+		ring* rings[] = { &fill_, &completion_, &rx_, &tx_ };
+		for (std::size_t i = 0; i < 4; ++i)
+			if (rings[i]->area)
+				::munmap(rings[i]->area, rings[i]->length);
+
+		if (umem_)
+			::munmap(umem_, static_cast<std::size_t>(frame_size_) * frame_count_);
+	}
+
+	// Takes back the request frames the kernel has finished sending.
+	void reclaim()
+	{
+		uint32_t producer = __atomic_load_n(completion_.producer, __ATOMIC_ACQUIRE);
+		uint32_t consumer = *completion_.consumer;
+		const uint64_t* completed = static_cast<const uint64_t*>(completion_.descriptors);
+
+		for (; consumer != producer; ++consumer)
+			free_frames_.push_back(completed[consumer & (completion_.size - 1)]);
+
+		__atomic_store_n(completion_.consumer, consumer, __ATOMIC_RELEASE);
+	}
+
+public:
+	// Frames taken from the ring have not been through the IP layer's checks yet.
+	checksum_verifier checksums_;
+
+	xdp_socket(boost::asio::io_context& socket_io_context, const std::string& interface_name, unsigned short identifier,
+		unsigned int queue = 0, bool skb_mode = true, unsigned int frame_size = 2048, unsigned int frame_count = 4096)
+		: descriptor_(socket_io_context), map_fd_(-1), program_fd_(-1), link_fd_(-1), umem_(0),
+		frame_size_(frame_size), frame_count_(frame_count), pending_(0)
+	{
+		std::memset(&fill_, 0, sizeof(fill_));
+		std::memset(&completion_, 0, sizeof(completion_));
+		std::memset(&rx_, 0, sizeof(rx_));
+		std::memset(&tx_, 0, sizeof(tx_));
+
+		try
+		{
+			open(interface_name, queue, identifier, skb_mode);
+		}
+		catch (...)
+		{
+			release();
+			throw;
+		}
+	}
+
+	~xdp_socket()
+	{
+		release();
+	}
+
+	xdp_socket(const xdp_socket&) = delete;
+	xdp_socket& operator=(const xdp_socket&) = delete;
+
+	int native_handle() { return descriptor_.native_handle(); }
+
+	void close() { descriptor_.close(); }
+
+	std::size_t pending() const { return pending_; }
+
+	// Writes the probe into a free UMEM frame and queues it. Returns false when every request
+	// frame is still owned by the kernel, in which case flush() and try again.
+	bool send(const echo_frame& frame, boost::asio::ip::address_v4 destination, unsigned short sequence_number)
+	{
+		if (frame.size() > frame_size_)
+			throw std::length_error("echo frame larger than UMEM frame");
+
+		if (free_frames_.empty())
+			reclaim();
+		if (free_frames_.empty())
+			return false;
+
+		uint64_t address = free_frames_.back();
+		free_frames_.pop_back();
+		frame.write(umem_ + address, destination, sequence_number);
+
+		uint32_t producer = *tx_.producer;
+		xdp_desc& desc = static_cast<xdp_desc*>(tx_.descriptors)[producer & (tx_.size - 1)];
+		desc.addr = address;
+		desc.len = static_cast<uint32_t>(frame.size());
+		desc.options = 0;
+		__atomic_store_n(tx_.producer, producer + 1, __ATOMIC_RELEASE);
+
+		++pending_;
+		return true;
+	}
+
+	// Kicks the kernel for the requests queued since the last flush. In SKB mode the kernel only
+	// takes a small batch per kick, so keep kicking for as long as it makes progress.
+	std::size_t flush()
+	{
+		std::size_t sent = 0;
+
+		while (pending_ > 0)
+		{
+			if (::sendto(descriptor_.native_handle(), 0, 0, MSG_DONTWAIT, 0, 0) < 0
+				&& errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+				throw_errno("AF_XDP send");
+
+			reclaim();
+
+			// Requests the kernel has not picked up yet stay queued for the next kick.
+			std::size_t queued = *tx_.producer - __atomic_load_n(tx_.consumer, __ATOMIC_ACQUIRE);
+			if (queued == pending_)
+				break;
+			sent += pending_ - queued;
+			pending_ = queued;
+		}
+
+		return sent;
+	}
+
+	// Hands every reply in the rx ring to handler(ipv4_hdr, icmp_hdr) and lends its frame back
+	// to the kernel through the fill ring. Returns the number of replies seen; never blocks.
+	template <typename Handler>
+	std::size_t poll(Handler& handler)
+	{
+		uint32_t producer = __atomic_load_n(rx_.producer, __ATOMIC_ACQUIRE);
+		uint32_t consumer = *rx_.consumer;
+		uint32_t fill_producer = *fill_.producer;
+		const xdp_desc* received = static_cast<const xdp_desc*>(rx_.descriptors);
+		uint64_t* fill = static_cast<uint64_t*>(fill_.descriptors);
+		std::size_t replies = 0;
+
+		for (; consumer != producer; ++consumer)
+		{
+			const xdp_desc& desc = received[consumer & (rx_.size - 1)];
+			const unsigned char* data = umem_ + desc.addr + 14;
+			std::size_t length = desc.len > 14 ? desc.len - 14 : 0;
+
+			ipv4_header ipv4_hdr;
+			icmp_header icmp_hdr;
+			if (checksums_.verify(data, length)
+				&& ipv4_hdr.parse(data, length)
+				&& icmp_hdr.parse(data + ipv4_hdr.header_length(), length - ipv4_hdr.header_length()))
+			{
+				handler(ipv4_hdr, icmp_hdr);
+				++replies;
+			}
+
+			// Every frame in the rx ring came from the fill ring, so there is always room to return it.
+			fill[fill_producer++ & (fill_.size - 1)] = desc.addr - desc.addr % frame_size_;
+		}
+
+		__atomic_store_n(rx_.consumer, consumer, __ATOMIC_RELEASE);
+		__atomic_store_n(fill_.producer, fill_producer, __ATOMIC_RELEASE);
+		return replies;
+	}
+
+	// Keeps handing replies to handler(ipv4_hdr, icmp_hdr) as they arrive, until the socket is closed.
+	template <typename Handler>
+	void async_receive(Handler handler)
+	{
+		descriptor_.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this, handler](const boost::system::error_code& error) mutable
+			{
+				//handle_receive lambda
+				if (error)
+					return;
+
+				poll(handler);
+				async_receive(handler);
+			});
+	}
+};
+
+#endif // defined(__linux__)
+
+#endif // XDP_SOCKET_HPP